@@ -10,7 +10,25 @@ namespace counter_gui {
 
 namespace {
 
+// builds with SNAPSHOT_STATE defined boot without log replay,
+// but keep only the recent history
+#ifdef SNAPSHOT_STATE
+SnapshotState saved_state;
+// without the log, serial line carries other bytes only
+std::function<int()> serial_read;
+std::function<void(uint8_t)> serial_other_byte;
+#else
 PersistentState saved_state;
+LogSync log_sync;
+#endif
+bool log_sync_enabled = false;
+// host asks for the next chunk right after the previous one, so the line
+// is watched this long after the last received byte or answer
+constexpr unsigned long log_sync_awake_ms = 1000;
+bool log_sync_received = false; // a byte was read since the last update()
+bool log_sync_active = false;
+unsigned long log_sync_active_ms = 0;
+HAL *device = nullptr;
 
 BatteryWidget battery;
 
@@ -22,7 +40,6 @@ AcceptScreen confirm_remove_history_screen;
 AcceptScreen confirm_new_count_screen;
 
 // global state and screen state
-int global_history_counter = 0;
 int short_history_counter = 0;
 Screen *screen[MAX_SCREEN_DEPTH];
 int active_screen;
@@ -30,28 +47,44 @@ int active_screen;
 void pushScreen(Screen *s) { screen[++active_screen] = s; }
 Screen *getActiveScreen() { return screen[active_screen]; }
 void popScreen() { active_screen--; }
+// screen on the display, other screens are redrawn in full when shown
+Screen *drawn_screen = nullptr;
 
-void changeCounter(int new_value, int delta) {
-  int old_value = new_value - delta;
-  // update short history
+// counter value known at the end of restore
+int restored_value = 0;
+
+void addShortHistoryItem(int delta) {
   short_history_counter++;
   char history_item[MAX_HIST_STR_LEN + 1];
   char sign = delta >= 0 ? '+' : '-';
   snprintf(history_item, MAX_HIST_STR_LEN, "%d.%c%d", short_history_counter,
            sign, std::abs(delta));
   main_screen.addHistoryItem(history_item);
+}
 
-  // update full history
-  global_history_counter++;
-  snprintf(history_item, MAX_HIST_STR_LEN, "%d. %d=%d%c%d",
-           global_history_counter, new_value, old_value, sign, std::abs(delta));
-  history_screen.addHistoryItem(history_item);
+void changeCounter(int new_value, int delta) {
+  addShortHistoryItem(delta);
+
+  // full history is read from the log
+  history_screen.historyChanged();
 
   main_screen.setCounter(new_value);
 }
 
+void restoreCheckpoint(const PersistentState::Checkpoint &cp) {
+  short_history_counter = cp.session_items;
+  restored_value = cp.value;
+}
+
+// restored values are the rows kept in the short history, the counter
+// is formatted once, when restore is done
+void restoreValue(int new_value, int delta) {
+  addShortHistoryItem(delta);
+  restored_value = new_value;
+}
+
 void startNewCounting() {
-  history_screen.addHistoryItem("------");
+  history_screen.historyChanged();
   short_history_counter = 0;
   main_screen.setCounter(0);
   main_screen.reset_history();
@@ -60,7 +93,41 @@ void startNewCounting() {
 void clearHistory() {
   startNewCounting();
   history_screen.clearHistory();
-  global_history_counter = 0;
+}
+
+int historySize() { return saved_state.historySize(); }
+
+void loadHistory(int first, int count, HistoryScreen::HistoryItem *items) {
+  saved_state.readHistory(
+      first, count, [&](int i, const PersistentState::HistoryRecord &r) {
+        char *item = items[i - first];
+        if (r.new_count) {
+          snprintf(item, MAX_HIST_STR_LEN, "------");
+          return;
+        }
+        char sign = r.delta >= 0 ? '+' : '-';
+        int len = snprintf(item, MAX_HIST_STR_LEN, "%d. %d=%d%c%d", r.item_no,
+                           r.value, r.value - r.delta, sign, std::abs(r.delta));
+        // pause before the value, if it is long enough to matter
+        unsigned seconds = r.interval / (1000 / PersistentState::time_unit_ms);
+        if (seconds > 0 && len < MAX_HIST_STR_LEN)
+          snprintf(item + len, MAX_HIST_STR_LEN - len,
+                   seconds < 100 ? " %us" : " %um",
+                   seconds < 100 ? seconds : seconds / 60);
+      });
+}
+
+// history row of the current count start, the row of its new count
+int currentCountRow() {
+#ifdef SNAPSHOT_STATE
+  return std::max(0, historySize() - short_history_counter - 1);
+#else
+  PersistentState::Session session;
+  if (!saved_state.findSession(saved_state.lastSession(), session))
+    return 0;
+  // history could be cleared after the new count
+  return std::max(0, saved_state.sessionHistoryRow(session));
+#endif
 }
 
 // callbacks moving between screens
@@ -105,9 +172,13 @@ void onItemSelect(int event) {
       pushScreen(&history_screen);
       break;
     case 2:
-      pushScreen(&confirm_new_count_screen);
+      pushScreen(&history_screen);
+      history_screen.showItem(currentCountRow());
       break;
     case 3:
+      pushScreen(&confirm_new_count_screen);
+      break;
+    case 4:
       pushScreen(&confirm_remove_history_screen);
       break;
     }
@@ -134,10 +205,12 @@ void onNewCountConfirmation(int event) {
 } // namespace
 
 void setup(HAL *hal) {
+  device = hal;
+  log_sync_active = false;
   active_screen = 0;
   short_history_counter = 0;
-  global_history_counter = 0;
   screen[0] = &main_screen;
+  drawn_screen = nullptr;
 
   // initialize battery widget
   battery.setParams();
@@ -148,7 +221,7 @@ void setup(HAL *hal) {
                     onMenuPress);
   delta_screen.setup(hal, onCommitRejectDelta);
   menu_screen.setup(hal, onItemSelect);
-  history_screen.setup(hal, onReturn);
+  history_screen.setup(hal, onReturn, historySize, loadHistory);
   confirm_remove_history_screen.setup(hal, "delete history",
                                       onDeleteHistoryConfirmation, onReturn);
   confirm_new_count_screen.setup(hal, "start new count", onNewCountConfirmation,
@@ -162,11 +235,82 @@ void setup(HAL *hal) {
   confirm_new_count_screen.addWidget(&battery);
 
   saved_state.setup(hal->persistentMemory());
-  saved_state.restoreFromMem(changeCounter, clearHistory, startNewCounting);
+#ifndef SNAPSHOT_STATE
+  saved_state.setClock([hal]() { return hal->uptimeMillis(); });
+#endif
+  // full history is paged from the log on demand, replaying
+  // short_history_items records is enough to restore main screen,
+  // records before the checkpoint are not passed to the screens at all,
+  // history clear and new count before them are part of the checkpoint
+  restored_value = 0;
+  saved_state.restoreFromMem(short_history_items, restoreCheckpoint,
+                             restoreValue, nullptr, nullptr);
+  main_screen.setCounter(restored_value);
+}
+
+void setupLogSync(std::function<int()> read,
+                  std::function<void(const uint8_t *, int)> write,
+                  std::function<void(uint8_t)> onOtherByte) {
+  log_sync_enabled = true;
+  auto watched_read = [read]() {
+    int byte = read();
+    if (byte >= 0)
+      log_sync_received = true;
+    return byte;
+  };
+#ifdef SNAPSHOT_STATE
+  serial_read = watched_read;
+  serial_other_byte = onOtherByte;
+#else
+  log_sync.setup(&saved_state, watched_read, write, onOtherByte);
+#endif
+}
+
+bool update() {
+  if (log_sync_enabled) {
+#ifdef SNAPSHOT_STATE
+    for (int byte = serial_read(); byte >= 0; byte = serial_read())
+      if (serial_other_byte)
+        serial_other_byte(byte);
+#else
+    // writing the last piece of an answer counts as traffic too
+    const bool answering = log_sync.busy();
+    log_sync.poll();
+    log_sync_received |= answering || log_sync.busy();
+#endif
+    if (log_sync_received) {
+      log_sync_received = false;
+      log_sync_active = true;
+      log_sync_active_ms = device->uptimeMillis();
+    }
+  }
+  bool updated = getActiveScreen()->update();
+  // changes are remembered on idle ticks, before the device goes to sleep,
+  // so button handlers do not wait for persistent memory
+  if (!updated)
+    saved_state.flush();
+  return updated;
 }
 
-bool update() { return getActiveScreen()->update(); }
+bool canSleep() {
+  if (log_sync_active &&
+      device->uptimeMillis() - log_sync_active_ms < log_sync_awake_ms)
+    return false;
+  log_sync_active = false;
+  return true;
+}
 
-void draw() { getActiveScreen()->draw(); }
+void draw() {
+  drawn_screen = getActiveScreen();
+  drawn_screen->draw();
+}
+
+void drawChanged() {
+  if (getActiveScreen() != drawn_screen) {
+    drawn_screen = getActiveScreen();
+    drawn_screen->redraw();
+  } else
+    drawn_screen->drawChanged();
+}
 
 } // namespace counter_gui
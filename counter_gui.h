@@ -9,8 +9,36 @@ void setup(HAL *hal);
 
 bool update();
 
+/**
+ * @brief tells whether the device could go to light sleep after update()
+ *
+ * UART bytes received during light sleep are lost, so the device stays
+ * awake while a log request is received or answered, and for a second
+ * after the last received byte.
+ */
+bool canSleep();
+
+// draws the active screen on the clear display
 void draw();
 
+/**
+ * @brief draws changes since the last draw
+ *
+ * Only areas of widgets changed in update() are cleared and redrawn,
+ * the whole display is cleared when the active screen is switched.
+ */
+void drawChanged();
+
+/**
+ * @brief serves the log to a host over a serial line, see LogSync
+ *
+ * Requests are handled in update(). Builds with SNAPSHOT_STATE have no log
+ * to serve, all received bytes are passed to onOtherByte then.
+ */
+void setupLogSync(std::function<int()> read,
+                  std::function<void(const uint8_t *, int)> write,
+                  std::function<void(uint8_t)> onOtherByte = nullptr);
+
 } // namespace counter_gui
 
 #endif // COUNTER_GUI_H
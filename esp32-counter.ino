@@ -1,4 +1,5 @@
 #include "counter_gui.h"
+#include <driver/uart.h>
 #include <esp_sleep.h>
 
 #define i2c_Address 0x3c
@@ -12,18 +13,58 @@
 #define RIGHT_BTN_PIN 14
 #define POWER_PIN 34
 #define STORAGE_SIZE (1 << 10)
+#define FLASH_STORAGE_SIZE (64 << 10)
 
 Adafruit_SH1106G display(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, OLED_RESET);
 
 Adafruit_FRAM_I2C raw_mem;
 PersistentMemoryWrapper mem(&raw_mem, STORAGE_SIZE);
+FlashMemory raw_flash;
+FlashMemoryWrapper flash(&raw_flash, FLASH_STORAGE_SIZE);
 HAL hal(&display, &mem, {LEFT_BTN_PIN, MID_BTN_PIN, RIGHT_BTN_PIN}, POWER_PIN);
 
+#ifdef PERSISTENT_MEMORY_STATS
+// prints memory traffic counters when 's' is received over serial
+void dumpMemoryStats(uint8_t command) {
+  if (command != 's')
+    return;
+  const PersistentMemoryWrapper *m = hal.persistentMemory();
+  const PersistentMemoryWrapper::Stats &stats = m->stats();
+  Serial.printf("reads %u, writes %u, bytes read %u, bytes written %u, "
+                "erases %u\n",
+                stats.reads, stats.writes, stats.bytes_read,
+                stats.bytes_written, stats.erases);
+  Serial.printf("bytes written per %d bytes of memory:", m->wearBucketSize());
+  for (int i = 0; i < PersistentMemoryWrapper::wear_buckets; ++i)
+    Serial.printf(" %u", stats.wear[i]);
+  Serial.println();
+}
+#endif
+
 void setup() {
   setCpuFrequencyMhz(80);
   Serial.begin(9600);
+  // received bytes wake the device from light sleep, the waking ones are
+  // lost, it stays awake after them, see counter_gui::canSleep()
+  uart_set_wakeup_threshold(UART_NUM_0, 3);
+  esp_sleep_enable_uart_wakeup(0);
   mem.setup();
+  if (!mem.isValid()) {
+    // boards without FRAM keep the log in flash
+    flash.setup();
+    hal.setPersistentMemory(&flash);
+  }
   counter_gui::setup(&hal);
+  // host pulls new log records over serial, see LogSync
+  counter_gui::setupLogSync(
+      []() { return Serial.read(); },
+      [](const uint8_t *data, int len) { Serial.write(data, len); },
+#ifdef PERSISTENT_MEMORY_STATS
+      dumpMemoryStats
+#else
+      nullptr
+#endif
+  );
 
   delay(250);
   display.begin(i2c_Address, true);
@@ -35,10 +76,9 @@ void setup() {
 void loop() {
   bool updated = counter_gui::update();
   if (updated) {
-    display.clearDisplay();
-    counter_gui::draw();
+    counter_gui::drawChanged();
     display.display();
-  } else {
+  } else if (counter_gui::canSleep()) {
     constexpr int timeout_us = 20000;
     esp_err_t timer_set = esp_sleep_enable_timer_wakeup(timeout_us);
     if (timer_set == ESP_OK)
@@ -0,0 +1,84 @@
+// Host tool, prints the event log of a persistent memory dump.
+// usage: fram_decode [--csv | --json] [--page-size N] image
+// Records are streamed as they are decoded, oldest first, so images
+// of any size are decoded in constant RAM.
+
+#include "state.h"
+#include <cstdio>
+#include <cstring>
+
+namespace {
+const char *opcodeName(PersistentState::LogRecord::Opcode opcode) {
+  switch (opcode) {
+  case PersistentState::LogRecord::new_value:
+    return "new_value";
+  case PersistentState::LogRecord::clear_history:
+    return "clear_history";
+  case PersistentState::LogRecord::new_count:
+    return "new_count";
+  }
+  return "unknown";
+}
+
+int usage(const char *name) {
+  fprintf(stderr, "usage: %s [--csv | --json] [--page-size N] image\n", name);
+  return 2;
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  bool json = false;
+  int page_size = PersistentState::default_page_size;
+  const char *path = nullptr;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--csv") == 0)
+      json = false;
+    else if (strcmp(argv[i], "--json") == 0)
+      json = true;
+    else if (strcmp(argv[i], "--page-size") == 0 && i + 1 < argc)
+      page_size = atoi(argv[++i]);
+    else if (argv[i][0] != '-' && !path)
+      path = argv[i];
+    else
+      return usage(argv[0]);
+  }
+  if (!path || page_size <= 0)
+    return usage(argv[0]);
+
+  PersistentMemory image(path);
+  if (!image.begin()) {
+    fprintf(stderr, "%s: can not read %s\n", argv[0], path);
+    return 1;
+  }
+  if (image.size() % page_size != 0 || image.size() / page_size < 2) {
+    fprintf(stderr, "%s: image size %d does not fit pages of %d bytes\n",
+            argv[0], image.size(), page_size);
+    return 1;
+  }
+  PersistentMemoryWrapper mem(&image, image.size());
+  mem.setup();
+  PersistentState state(&mem, page_size);
+
+  if (json)
+    printf("[");
+  else
+    printf("offset,opcode,value,delta,session,time_ms,archived\n");
+  bool first = true;
+  state.decodeLog([&](const PersistentState::LogRecord &record) {
+    const char *format =
+        json ? "%s\n  {\"offset\": %d, \"opcode\": \"%s\", \"value\": %d, "
+               "\"delta\": %d, \"session\": %u, \"time_ms\": %llu, "
+               "\"archived\": %s}"
+             : "%s%d,%s,%d,%d,%u,%llu,%s\n";
+    printf(format, json && !first ? "," : "", record.offset,
+           opcodeName(record.opcode), record.value, record.delta,
+           static_cast<unsigned>(record.session),
+           static_cast<unsigned long long>(record.time) *
+               PersistentState::time_unit_ms,
+           record.archived ? "true" : "false");
+    first = false;
+  });
+  if (json)
+    printf(first ? "]\n" : "\n]\n");
+  return 0;
+}
@@ -0,0 +1,284 @@
+// Host tool, aggregates statistics of many persistent memory dumps.
+// usage: fram_stats [--threads N] [--page-size N] dir|image...
+// Directories are scanned for dump files (not recursively). Images are
+// decoded in parallel, every worker keeps its own statistics, which are
+// summed up at the end, so workers share nothing but the work queues.
+
+#include "state.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <dirent.h>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <vector>
+
+namespace {
+// |delta| is counted by its bit length, the last bucket takes the rest
+constexpr int delta_buckets = 12;
+
+struct Stats {
+  long images = 0;
+  long long bytes = 0;
+  long unreadable = 0; // could not be read or do not fit the page size
+  long empty = 0;      // no valid records, blank or corrupted
+  long wrapped = 0;    // log start was overwritten
+  long torn = 0;       // images whose log ends with a torn record
+  long broken = 0;     // images with bad crc or garbage before the end
+  long broken_pages = 0;
+  long records = 0;
+  long archived = 0; // records read from the archive
+  long values = 0;
+  long clears = 0;
+  long new_counts = 0;
+  long sessions = 0; // runs of values between new counts and clears
+  long max_session_values = 0;
+  long negative_deltas = 0;
+  long deltas[delta_buckets] = {};
+
+  void add(const Stats &other) {
+    images += other.images;
+    bytes += other.bytes;
+    unreadable += other.unreadable;
+    empty += other.empty;
+    wrapped += other.wrapped;
+    torn += other.torn;
+    broken += other.broken;
+    broken_pages += other.broken_pages;
+    records += other.records;
+    archived += other.archived;
+    values += other.values;
+    clears += other.clears;
+    new_counts += other.new_counts;
+    sessions += other.sessions;
+    max_session_values =
+        std::max(max_session_values, other.max_session_values);
+    negative_deltas += other.negative_deltas;
+    for (int i = 0; i < delta_buckets; ++i)
+      deltas[i] += other.deltas[i];
+  }
+};
+
+/**
+ * @brief queues of images to decode, one per worker
+ *
+ * Images are dealt to the queues up front. A worker takes images from
+ * the front of its own queue and, when it is empty, steals from the back
+ * of the others, so a few large images do not leave cores idle. No work
+ * is added later, so a worker which finds all queues empty is done.
+ */
+class WorkStealingQueues {
+  struct Queue {
+    std::mutex lock;
+    std::deque<size_t> items;
+  };
+  std::vector<Queue> queues;
+
+public:
+  WorkStealingQueues(int workers, size_t items) : queues(workers) {
+    for (size_t i = 0; i < items; ++i)
+      queues[i % workers].items.push_back(i);
+  }
+
+  bool take(int worker, size_t &item) {
+    const int workers = queues.size();
+    for (int i = 0; i < workers; ++i) {
+      Queue &queue = queues[(worker + i) % workers];
+      std::lock_guard<std::mutex> guard(queue.lock);
+      if (queue.items.empty())
+        continue;
+      if (i == 0) {
+        item = queue.items.front();
+        queue.items.pop_front();
+      } else {
+        item = queue.items.back();
+        queue.items.pop_back();
+      }
+      return true;
+    }
+    return false;
+  }
+};
+
+int deltaBucket(int delta) {
+  unsigned magnitude = delta < 0 ? 0u - delta : delta;
+  int bits = 0;
+  while (magnitude > 0 && bits < delta_buckets - 1) {
+    magnitude >>= 1;
+    bits++;
+  }
+  return bits;
+}
+
+void analyze(const std::string &path, int page_size, Stats &stats) {
+  stats.images++;
+  PersistentMemory image(path.c_str());
+  if (!image.begin() || image.size() % page_size != 0 ||
+      image.size() / page_size < 2) {
+    stats.unreadable++;
+    return;
+  }
+  stats.bytes += image.size();
+  PersistentMemoryWrapper mem(&image, image.size());
+  mem.setup();
+  PersistentState state(&mem, page_size);
+
+  long records = 0;
+  long session_values = 0;
+  auto endSession = [&]() {
+    if (session_values > 0)
+      stats.sessions++;
+    stats.max_session_values =
+        std::max(stats.max_session_values, session_values);
+    session_values = 0;
+  };
+  auto onRecord = [&](const PersistentState::LogRecord &r) {
+    if (records++ == 0 && r.events > 0)
+      stats.wrapped++;
+    if (r.archived)
+      stats.archived++;
+    switch (r.opcode) {
+    case PersistentState::LogRecord::new_value:
+      stats.values++;
+      session_values++;
+      stats.deltas[deltaBucket(r.delta)]++;
+      if (r.delta < 0)
+        stats.negative_deltas++;
+      break;
+    case PersistentState::LogRecord::clear_history:
+      stats.clears++;
+      endSession();
+      break;
+    case PersistentState::LogRecord::new_count:
+      stats.new_counts++;
+      endSession();
+      break;
+    }
+  };
+  const PersistentState::LogDamage damage = state.decodeLog(onRecord);
+  endSession();
+  stats.records += records;
+  if (records == 0)
+    stats.empty++;
+  if (damage.torn_tails > 0)
+    stats.torn++;
+  if (damage.broken_pages > 0)
+    stats.broken++;
+  stats.broken_pages += damage.broken_pages;
+}
+
+// adds regular files of the directory, or the path itself if it is a file
+bool collectImages(const char *path, std::vector<std::string> &images) {
+  struct stat st;
+  if (stat(path, &st) != 0)
+    return false;
+  if (!S_ISDIR(st.st_mode)) {
+    images.push_back(path);
+    return true;
+  }
+  DIR *dir = opendir(path);
+  if (!dir)
+    return false;
+  std::vector<std::string> files;
+  while (dirent *entry = readdir(dir)) {
+    std::string file = std::string(path) + "/" + entry->d_name;
+    if (entry->d_name[0] != '.' && stat(file.c_str(), &st) == 0 &&
+        S_ISREG(st.st_mode))
+      files.push_back(file);
+  }
+  closedir(dir);
+  // output does not depend on the directory order
+  std::sort(files.begin(), files.end());
+  images.insert(images.end(), files.begin(), files.end());
+  return true;
+}
+
+void printStats(const Stats &stats) {
+  printf("images        %ld (%.1f MB)\n", stats.images, stats.bytes / 1e6);
+  printf("unreadable    %ld\n", stats.unreadable);
+  printf("empty         %ld\n", stats.empty);
+  printf("wrapped       %ld\n", stats.wrapped);
+  printf("torn tail     %ld\n", stats.torn);
+  printf("broken        %ld (%ld pages)\n", stats.broken, stats.broken_pages);
+  printf("records       %ld, %ld archived\n", stats.records, stats.archived);
+  printf("values        %ld\n", stats.values);
+  printf("clears        %ld\n", stats.clears);
+  printf("new counts    %ld\n", stats.new_counts);
+  printf("sessions      %ld, values per session: mean %.1f, max %ld\n",
+         stats.sessions,
+         stats.sessions > 0 ? double(stats.values) / stats.sessions : 0.0,
+         stats.max_session_values);
+  printf("deltas        %ld negative\n", stats.negative_deltas);
+  for (int i = 0; i < delta_buckets; ++i) {
+    if (stats.deltas[i] == 0)
+      continue;
+    char range[32];
+    if (i == 0)
+      snprintf(range, sizeof(range), "0");
+    else if (i == 1)
+      snprintf(range, sizeof(range), "1");
+    else if (i == delta_buckets - 1)
+      snprintf(range, sizeof(range), "%d+", 1 << (i - 1));
+    else
+      snprintf(range, sizeof(range), "%d-%d", 1 << (i - 1), (1 << i) - 1);
+    printf("  |delta| %-9s %ld (%.1f%%)\n", range, stats.deltas[i],
+           100.0 * stats.deltas[i] / stats.values);
+  }
+}
+
+int usage(const char *name) {
+  fprintf(stderr, "usage: %s [--threads N] [--page-size N] dir|image...\n",
+          name);
+  return 2;
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  int threads = std::thread::hardware_concurrency();
+  int page_size = PersistentState::default_page_size;
+  std::vector<std::string> images;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+      threads = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--page-size") == 0 && i + 1 < argc)
+      page_size = atoi(argv[++i]);
+    else if (argv[i][0] == '-')
+      return usage(argv[0]);
+    else if (!collectImages(argv[i], images)) {
+      fprintf(stderr, "%s: can not read %s\n", argv[0], argv[i]);
+      return 1;
+    }
+  }
+  if (images.empty() || page_size <= 0)
+    return usage(argv[0]);
+  // hardware_concurrency() could be unknown
+  threads = std::max(1, std::min<int>(threads, images.size()));
+
+  WorkStealingQueues queues(threads, images.size());
+  std::vector<Stats> results(threads);
+  std::vector<std::thread> workers;
+  auto start = std::chrono::steady_clock::now();
+  for (int worker = 0; worker < threads; ++worker)
+    workers.emplace_back([&, worker]() {
+      size_t item = 0;
+      while (queues.take(worker, item))
+        analyze(images[item], page_size, results[worker]);
+    });
+  for (std::thread &worker : workers)
+    worker.join();
+  std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+
+  Stats total;
+  for (const Stats &result : results)
+    total.add(result);
+  printStats(total);
+  printf("threads %d, %.3f s, %.1f images/s, %.1f MB/s\n", threads,
+         time.count(), total.images / time.count(),
+         total.bytes / 1e6 / time.count());
+  return 0;
+}
@@ -1,6 +1,52 @@
 #include "hal.h"
 
 #ifdef TEST_MODE
+#include <climits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+PersistentMemory::PersistentMemory(const char *path, int size)
+    : data(nullptr), data_size(0), valid(false) {
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+    return;
+  if (ftruncate(fd, size) == 0) {
+    void *addr =
+        mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr != MAP_FAILED) {
+      data = static_cast<uint8_t *>(addr);
+      data_size = size;
+      valid = true;
+    }
+  }
+  close(fd);
+}
+
+PersistentMemory::PersistentMemory(const char *path)
+    : data(nullptr), data_size(0), valid(false), read_only(true) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0 && st.st_size <= INT_MAX) {
+    void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr != MAP_FAILED) {
+      // log is decoded mostly forward, read pages are not needed again
+      madvise(addr, st.st_size, MADV_SEQUENTIAL);
+      data = static_cast<uint8_t *>(addr);
+      data_size = st.st_size;
+      valid = true;
+    }
+  }
+  close(fd);
+}
+
+PersistentMemory::~PersistentMemory() {
+  if (!heap_data && data)
+    munmap(data, data_size);
+}
 
 #else
 
@@ -50,40 +50,292 @@ public:
 #include <memory>
 
 class PersistentMemory {
-  std::unique_ptr<uint8_t[]> data;
+  std::unique_ptr<uint8_t[]> heap_data;
+  uint8_t *data;
+  int data_size;
   bool valid;
+  bool read_only = false;
+  int write_limit = -1;
+  mutable int bytes_read = 0;
+  int bytes_written = 0;
 
 public:
   PersistentMemory(bool valid, int size)
-      : data(new uint8_t[size]), valid(valid) {
-    std::fill(data.get(), data.get() + size, 0);
+      : heap_data(new uint8_t[size]), data(heap_data.get()), data_size(size),
+        valid(valid) {
+    std::fill(data, data + size, 0);
   }
 
+  /**
+   * @brief memory image kept in a file
+   *
+   * File is memory mapped, so multi-megabyte images are cheap and
+   * simulated device keeps its state across runs. New file is zero filled.
+   * Used by state_benchmark to keep its images, see its image_dir.
+   */
+  PersistentMemory(const char *path, int size);
+
+  /**
+   * @brief existing memory image opened for reading only
+   *
+   * Size is taken from the file, pages of the image are read on demand
+   * and could be dropped after use, so images of any size are inspected
+   * in constant RAM. Writes are not allowed.
+   */
+  explicit PersistentMemory(const char *path);
+
+  PersistentMemory(const PersistentMemory &) = delete;
+  PersistentMemory &operator=(const PersistentMemory &) = delete;
+
+  ~PersistentMemory();
+
   bool begin() const { return valid; }
 
-  uint8_t read(int addr) const { return data[addr]; }
+  int size() const { return data_size; }
+
+  // simulates power loss: bytes after the limit are not written,
+  // negative limit disables simulation
+  void setWriteLimit(int bytes) { write_limit = bytes; }
+
+  // number of bytes transferred since the last reset
+  int bytesRead() const { return bytes_read; }
+  int bytesWritten() const { return bytes_written; }
+  void resetCounters() { bytes_read = bytes_written = 0; }
+
+  uint8_t read(int addr) const {
+    bytes_read++;
+    return data[addr];
+  }
+
+  void write(int addr, uint8_t value) {
+    assert(!read_only);
+    bytes_written++;
+    if (write_limit == 0)
+      return;
+    if (write_limit > 0)
+      write_limit--;
+    data[addr] = value;
+  }
+
+  bool read(int addr, uint8_t *buffer, int num) const {
+    bytes_read += num;
+    std::copy(data + addr, data + addr + num, buffer);
+    return true;
+  }
+
+  bool write(int addr, const uint8_t *buffer, int num) {
+    for (int i = 0; i < num; ++i)
+      write(addr + i, buffer[i]);
+    return true;
+  }
+};
+
+// NOR flash simulator: programming only clears bits,
+// erase sets whole blocks to 0xff
+class FlashMemory {
+  std::unique_ptr<uint8_t[]> data;
+  std::unique_ptr<int[]> erase_counts;
+  int mem_size;
+  int block_size;
+  int bytes_programmed = 0;
+  int bytes_overwritten = 0;
+
+public:
+  FlashMemory(int size, int erase_size)
+      : data(new uint8_t[size]), erase_counts(new int[size / erase_size]),
+        mem_size(size), block_size(erase_size) {
+    assert(size % erase_size == 0);
+    std::fill(data.get(), data.get() + size, 0xff);
+    std::fill(erase_counts.get(), erase_counts.get() + size / erase_size, 0);
+  }
+
+  bool begin() const { return true; }
 
-  void write(int addr, uint8_t value) { data[addr] = value; }
+  int size() const { return mem_size; }
+
+  int eraseSize() const { return block_size; }
+
+  // number of erases of the block since the last reset
+  int eraseCount(int block) const { return erase_counts[block]; }
+  int bytesProgrammed() const { return bytes_programmed; }
+  // bytes programmed again without erase
+  int bytesOverwritten() const { return bytes_overwritten; }
+  void resetCounters() {
+    bytes_programmed = bytes_overwritten = 0;
+    std::fill(erase_counts.get(), erase_counts.get() + mem_size / block_size,
+              0);
+  }
+
+  bool read(int addr, uint8_t *buffer, int num) const {
+    std::copy(data.get() + addr, data.get() + addr + num, buffer);
+    return true;
+  }
+
+  bool write(int addr, const uint8_t *buffer, int num) {
+    bytes_programmed += num;
+    for (int i = 0; i < num; ++i) {
+      bytes_overwritten += data[addr + i] != 0xff;
+      data[addr + i] &= buffer[i];
+    }
+    return true;
+  }
+
+  bool erase(int addr, int num) {
+    assert(addr % block_size == 0 && num % block_size == 0);
+    std::fill(data.get() + addr, data.get() + addr + num, 0xff);
+    for (int block = addr / block_size; block < (addr + num) / block_size;
+         ++block)
+      erase_counts[block]++;
+    return true;
+  }
 };
 
 #else // TEST_MODE
 #include "Adafruit_FRAM_I2C.h"
+#include <esp_partition.h>
 
 using PersistentMemory = Adafruit_FRAM_I2C;
 
+// NOR flash of the module, the first data partition labeled "counter"
+// or the spiffs partition of default partition scheme is used
+class FlashMemory {
+  const esp_partition_t *partition = nullptr;
+
+public:
+  bool begin() {
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                         ESP_PARTITION_SUBTYPE_ANY, "counter");
+    if (!partition)
+      partition = esp_partition_find_first(
+          ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, nullptr);
+    return partition != nullptr;
+  }
+
+  int size() const { return partition ? partition->size : 0; }
+
+  // flash sector size
+  int eraseSize() const { return 4096; }
+
+  bool read(int addr, uint8_t *buffer, int num) const {
+    return esp_partition_read(partition, addr, buffer, num) == ESP_OK;
+  }
+
+  bool write(int addr, const uint8_t *buffer, int num) {
+    return esp_partition_write(partition, addr, buffer, num) == ESP_OK;
+  }
+
+  bool erase(int addr, int num) {
+    return esp_partition_erase_range(partition, addr, num) == ESP_OK;
+  }
+};
+
 #endif // TEST_MODE
 
+/**
+ * @brief thin layer over persistent memory chip
+ *
+ * Block operations wrap around the end of memory and are split into
+ * transactions of at most max_transfer_size bytes, so every chunk fits
+ * into I2C driver buffer.
+ * Other storage backends derive from it and override block operations.
+ */
 class PersistentMemoryWrapper {
+#ifdef PERSISTENT_MEMORY_STATS
+public:
+  static constexpr int wear_buckets = 64;
+
+  /**
+   * @brief memory traffic counters
+   *
+   * Kept only when PERSISTENT_MEMORY_STATS is defined for the whole build,
+   * otherwise counting compiles to nothing.
+   * Every transaction of a block operation is counted separately.
+   * wear[i] is number of bytes written to i-th of wear_buckets equal
+   * parts of memory.
+   */
+  struct Stats {
+    uint32_t reads = 0;
+    uint32_t writes = 0;
+    uint32_t bytes_read = 0;
+    uint32_t bytes_written = 0;
+    uint32_t erases = 0;
+    uint32_t wear[wear_buckets] = {0};
+  };
+
+  const Stats &stats() const { return mem_stats; }
+
+  void resetStats() { mem_stats = Stats(); }
+
+  // number of bytes covered by one wear bucket
+  int wearBucketSize() const {
+    return (mem_size + wear_buckets - 1) / wear_buckets;
+  }
+
 private:
+  mutable Stats mem_stats;
+#endif // PERSISTENT_MEMORY_STATS
+
+private:
+  static constexpr int max_transfer_size = 32;
+
   PersistentMemory *raw_mem;
+
+protected:
   bool valid;
   int mem_size;
 
+  PersistentMemoryWrapper(int size)
+      : raw_mem(nullptr), mem_size(size), valid(false) {}
+
+  void countRead(int len) const {
+#ifdef PERSISTENT_MEMORY_STATS
+    mem_stats.reads++;
+    mem_stats.bytes_read += len;
+#endif
+  }
+
+  void countWrite(int addr, int len) {
+#ifdef PERSISTENT_MEMORY_STATS
+    mem_stats.writes++;
+    mem_stats.bytes_written += len;
+    const int bucket_size = wearBucketSize();
+    while (len > 0) {
+      int bucket = addr / bucket_size;
+      int bucket_len = std::min(len, (bucket + 1) * bucket_size - addr);
+      mem_stats.wear[bucket] += bucket_len;
+      addr += bucket_len;
+      len -= bucket_len;
+    }
+#endif
+  }
+
+  void countErase() {
+#ifdef PERSISTENT_MEMORY_STATS
+    mem_stats.erases++;
+#endif
+  }
+
+  // calls f(addr, offset, len) for every chunk of the block
+  template <typename F>
+  void forEachChunk(int addr, int len, int max_chunk, F f) const {
+    assert(addr >= 0 && len >= 0 && len <= mem_size);
+    addr %= mem_size;
+    int offset = 0;
+    while (offset < len) {
+      int chunk = std::min({len - offset, mem_size - addr, max_chunk});
+      f(addr, offset, chunk);
+      offset += chunk;
+      addr = (addr + chunk) % mem_size;
+    }
+  }
+
 public:
   PersistentMemoryWrapper(PersistentMemory *raw_mem, int size)
       : raw_mem(raw_mem), mem_size(size), valid(false) {}
 
-  void setup() {
+  virtual ~PersistentMemoryWrapper() = default;
+
+  virtual void setup() {
     if (raw_mem->begin())
       valid = true;
   }
@@ -92,9 +344,92 @@ public:
 
   int size() const { return mem_size; }
 
-  uint8_t read(int addr) const { return raw_mem->read(addr); }
+  /**
+   * @brief size of the block erased at once, 1 if bytes are rewritable
+   *
+   * Bytes of non-rewritable memory could be written only once after erase.
+   */
+  virtual int eraseSize() const { return 1; }
+
+  /**
+   * @brief prepares aligned range for writing, all bytes read as zero then
+   */
+  virtual void erase(int addr, int len) {}
+
+  uint8_t read(int addr) const {
+    uint8_t value;
+    readBlock(addr, &value, 1);
+    return value;
+  }
 
-  void write(int addr, uint8_t value) { raw_mem->write(addr, value); }
+  void write(int addr, uint8_t value) { writeBlock(addr, &value, 1); }
+
+  virtual void readBlock(int addr, uint8_t *buffer, int len) const {
+    forEachChunk(addr, len, max_transfer_size,
+                 [&](int chunk_addr, int offset, int chunk) {
+                   countRead(chunk);
+                   raw_mem->read(chunk_addr, buffer + offset, chunk);
+                 });
+  }
+
+  virtual void writeBlock(int addr, const uint8_t *buffer, int len) {
+    forEachChunk(addr, len, max_transfer_size,
+                 [&](int chunk_addr, int offset, int chunk) {
+                   countWrite(chunk_addr, chunk);
+                   raw_mem->write(chunk_addr, buffer + offset, chunk);
+                 });
+  }
+};
+
+/**
+ * @brief persistent memory over NOR flash
+ *
+ * Programming could only clear bits, erase sets whole blocks back.
+ * Bytes are stored inverted, so erased flash reads as zeros like fresh
+ * FRAM, and zero bytes could be programmed later.
+ */
+class FlashMemoryWrapper : public PersistentMemoryWrapper {
+  static constexpr int chunk_size = 64;
+
+  FlashMemory *flash;
+
+public:
+  FlashMemoryWrapper(FlashMemory *flash, int size)
+      : PersistentMemoryWrapper(size), flash(flash) {}
+
+  void setup() override {
+    valid = flash->begin() && flash->size() >= mem_size &&
+            mem_size % flash->eraseSize() == 0;
+  }
+
+  int eraseSize() const override { return flash->eraseSize(); }
+
+  void erase(int addr, int len) override {
+    assert(addr % eraseSize() == 0 && len % eraseSize() == 0);
+    countErase();
+    flash->erase(addr, len);
+  }
+
+  void readBlock(int addr, uint8_t *buffer, int len) const override {
+    forEachChunk(addr, len, chunk_size,
+                 [&](int chunk_addr, int offset, int chunk) {
+                   countRead(chunk);
+                   flash->read(chunk_addr, buffer + offset, chunk);
+                   for (int i = offset; i < offset + chunk; ++i)
+                     buffer[i] = ~buffer[i];
+                 });
+  }
+
+  void writeBlock(int addr, const uint8_t *buffer, int len) override {
+    forEachChunk(addr, len, chunk_size,
+                 [&](int chunk_addr, int offset, int chunk) {
+                   uint8_t inverted[chunk_size];
+                   for (int i = 0; i < chunk; ++i)
+                     inverted[i] = ~buffer[offset + i];
+                   countWrite(chunk_addr, chunk);
+                   flash->write(chunk_addr, inverted, chunk);
+                 });
+  }
 };
 
 #ifdef TEST_MODE
@@ -183,6 +518,8 @@ public:
 
   PersistentMemoryWrapper *persistentMemory() const { return mem; }
 
+  void setPersistentMemory(PersistentMemoryWrapper *m) { mem = m; }
+
   bool buttonPressed(int button_no) const {
     return !digitalRead(button_pin[button_no]);
   }
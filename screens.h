@@ -13,19 +13,55 @@ namespace counter_gui {
 constexpr int lower_panel_height = 11;
 constexpr int max_counter_font_size = 6;
 constexpr int counter_width = 2 * max_counter_font_size * CHAR_W;
-
+constexpr int short_history_items = 8;
+constexpr int history_cache_items = 16;
+
+/**
+ * @brief set of widgets drawn together
+ *
+ * Areas changed by update() are merged into non-overlapping rects,
+ * drawChanged() clears them and redraws widgets touching them only.
+ */
 class Screen {
   Widget *w[MAX_WIDGETS];
   int size = 0;
+  Display *display = nullptr;
   int screen_width = 0;
   int screen_height = 0;
   int lower_panel_y = 0;
+  Rect changed[MAX_WIDGETS];
+  int changed_size = 0;
+
+  void addChangedArea(Rect r) {
+    if (r.empty())
+      return;
+    // merged rect could overlap rects checked before, start over
+    for (int i = 0; i < changed_size;) {
+      if (changed[i].intersects(r)) {
+        r = r.merged(changed[i]);
+        changed[i] = changed[--changed_size];
+        i = 0;
+      } else
+        ++i;
+    }
+    assert(changed_size < MAX_WIDGETS);
+    changed[changed_size++] = r;
+  }
+
+  bool touchesChangedArea(const Widget *widget) const {
+    for (int i = 0; i < changed_size; ++i)
+      if (changed[i].intersects(widget->bounds()))
+        return true;
+    return false;
+  }
 
 public:
   void setup(HAL *h) {
     size = 0;
-    screen_width = h->display()->width();
-    screen_height = h->display()->height();
+    changed_size = 0;
+    display = h->display();
+    screen_width = display->width();
+    screen_height = display->height();
     lower_panel_y = screen_height - lower_panel_height;
   }
 
@@ -39,20 +75,44 @@ public:
 
   bool update() {
     bool updated = false;
-    for (int i = 0; i < size; ++i)
-      updated |= w[i]->update();
+    for (int i = 0; i < size; ++i) {
+      if (w[i]->update()) {
+        updated = true;
+        addChangedArea(w[i]->changedArea());
+      }
+    }
     return updated;
   }
 
+  // draws all widgets on the clear display
   void draw() {
     for (int i = 0; i < size; ++i)
       w[i]->draw();
+    changed_size = 0;
+  }
+
+  // clears the whole display and draws all widgets
+  void redraw() {
+    display->fillRect(0, 0, screen_width, screen_height, Color::BLACK);
+    draw();
+  }
+
+  // clears changed areas and draws widgets over them, in the usual order,
+  // so overlapping widgets look the same as after draw()
+  void drawChanged() {
+    for (int i = 0; i < changed_size; ++i)
+      display->fillRect(changed[i].x, changed[i].y, changed[i].w,
+                        changed[i].h, Color::BLACK);
+    for (int i = 0; i < size; ++i)
+      if (touchesChangedArea(w[i]))
+        w[i]->draw();
+    changed_size = 0;
   }
 };
 
 class MainScreen : public Screen {
   LabelWidget<> counter;
-  OverwritingListWidget<8> short_history;
+  OverwritingListWidget<short_history_items> short_history;
   ThreeStateButtonWidget plus_minus_1;
   ThreeStateButtonWidget plus_minus_5;
   TwoStateButtonWidget menu;
@@ -190,6 +250,7 @@ public:
     menu_items.setParams(width(), height() - lower_panel_height, 0);
     menu_items.addItem("go to main screen");
     menu_items.addItem("show full history");
+    menu_items.addItem("show current count");
     menu_items.addItem("start new counting");
     menu_items.addItem("drop full history");
     menu_up.setParams("\x1e", LEFT_BUTTON_ID,
@@ -216,17 +277,23 @@ class HistoryScreen : public Screen {
   RepeatingButtonWidget history_up;
   RepeatingButtonWidget history_down;
   TwoStateButtonWidget history_return;
-  OverwritingListWidget<128> history_items;
+  PagedListWidget<history_cache_items> history_items;
 
   void historyUpRelease(int event) { history_items.moveUp(); }
 
   void historyDownRelease(int event) { history_items.moveDown(); }
 
 public:
-  void setup(HAL *hal, std::function<void(int)> returnRelease) {
+  using HistoryItem = decltype(history_items)::Item;
+
+  // history items are loaded from the source when they become visible
+  void setup(HAL *hal, std::function<void(int)> returnRelease,
+             std::function<int()> historySize,
+             std::function<void(int, int, HistoryItem *)> loadHistory) {
     Screen::setup(hal);
 
-    history_items.setParams(width(), height() - lower_panel_height);
+    history_items.setParams(width(), height() - lower_panel_height,
+                            historySize, loadHistory);
     history_up.setParams("\x1e", LEFT_BUTTON_ID,
                          [this](int event) { historyUpRelease(event); });
     history_down.setParams("\x1f", MIDDLE_BUTTON_ID,
@@ -244,7 +311,10 @@ public:
     addWidget(&history_return);
   }
 
-  void addHistoryItem(const char *item) { history_items.addItem(item); }
+  void historyChanged() { history_items.invalidate(); }
+
+  // jumps to the history item, e.g. to the start of a session
+  void showItem(int i) { history_items.scrollTo(i); }
 
   void clearHistory() { history_items.reset(); }
 };
@@ -1,133 +1,1737 @@
 #include "state.h"
-#include <memory>
+#include <climits>
 
-#define WRAP(offset) ((offset) % mem_size)
+// Memory is split into pages of equal size, used as a ring.
+// Each page starts with a header:
+// uint32 sequence number (little endian), grows by one with every new page,
+//        zero marks unused page
+// varint number of records logged before the page
+// zigzag varint counter value
+// varint number of values added since history was cleared
+// varint number of values added since new count was started
+// varint number of records since history was cleared
+// varint log time of the last record before the page, in time units
+// varint number of new counts before the page
+// crc8 of all previous header bytes
+// Checkpoint fields describe the state at the page start, so every page
+// anchors times of its records, and sessions are found with binary search
+// over the checkpoints, without any index.
+// Header is followed by records:
+// 1xxxxxxx add new number, xxxxxxx is zigzag encoded delta in [-64, 63]
+// 1 add new number, followed by zigzag varint delta
+// 2 clear history
+// 3 start new count
+// 0 end of records in the page
+// Every record except the end mark is followed by varint time passed since
+// the previous record, in time units, and crc8 of its bytes,
+// seeded with the page sequence number. Record corrupted or left from
+// previous lap of the ring fails the check and ends the log.
+// Records never cross page boundary, so pages [0, head] always have
+// consecutive sequence numbers and the head page could be found with
+// binary search instead of scanning the whole memory.
+// Large rewritable memories keep the archive after the log,
+// a ring of pages filled with compressed records of evicted log pages:
+// uint32 sequence number of the archive page, zero marks unused page
+// crc8 of the sequence number
+// blocks of records, every block is:
+//   1 block mark, or 2 if the block continues the previous one
+//   varint fields of the checkpoint at the block start, as in page header,
+//   only after mark 1, the first block of a page always has them
+//   varint number of records in the block
+//   varint size of the block data
+//   block data:
+//     byte of Rice parameters, k of deltas in low 4 bits, k of times
+//     in high 4 bits, chosen for the records of the evicted page
+//     records packed in bits, from the least significant bit of a byte:
+//     0 and Rice coded zigzag delta, add new number
+//     1 0 clear history
+//     1 1 start new count
+//     every record is followed by Rice coded time passed since the
+//     previous record, the last byte is padded with zero bits
+//   crc8 of all previous block bytes, seeded with the page sequence number
+// 0 end of blocks in the page
+// Rice code of v with parameter k is v >> k in unary, as one bits ended
+// by a zero bit, then k low bits of v. Values with v >> k of at least
+// rice_escape are rice_escape one bits and then 32 bits of v. Deltas of
+// a counter are small and button presses come at a steady pace, so most
+// records take one or two bytes instead of three in the log.
+// Page is archived right before it is overwritten, so the archive continues
+// to the log start and restore does not need it.
+// Log time runs while the device is on, the first record after restart
+// continues from the last logged one.
+// On flash pages are aligned to erase blocks and erased before reuse,
+// so every byte is programmed once between erases and the ring gives
+// round-robin wear leveling.
 
 namespace {
-constexpr int end_mark_size = 3;
+constexpr int seq_size = 4;
+constexpr int crc_size = 1;
+constexpr int max_varint_size = 5;
+constexpr int checkpoint_fields = 7;
+constexpr int max_page_header_size =
+    seq_size + checkpoint_fields * max_varint_size + crc_size;
+constexpr int max_record_size = 1 + 2 * max_varint_size + crc_size;
+constexpr uint8_t end_of_page = 0;
+constexpr uint8_t new_value_record = 1;
+constexpr uint8_t clear_history_record = 2;
+constexpr uint8_t new_count_record = 3;
+constexpr uint8_t archive_block_mark = 1;
+constexpr uint8_t archive_continue_mark = 2;
+constexpr uint8_t short_delta_flag = 0x80;
+constexpr uint8_t crc_init = 0xff;
+constexpr int archive_header_size = seq_size + crc_size;
+constexpr int rice_escape = 16;
+constexpr int max_rice_k = 15;
+constexpr int max_rice_bits = rice_escape + 32;
+constexpr int max_archive_record_size = (2 + 2 * max_rice_bits + 7) / 8;
+// blocks are packed in a stack buffer, longer runs are split into blocks
+// continuing each other
+constexpr int max_archive_block_data = 256;
+// archive pages are smaller than max_archive_page_size, so number of
+// records and size of a block take two varint bytes
+constexpr int max_archive_page_size = 1 << 14;
+constexpr int max_archive_block_header_size =
+    1 + checkpoint_fields * max_varint_size + 2 * 2;
 
-bool isEndMark(uint8_t *mem, int pos, int mem_size) {
-  if (mem[WRAP(pos)] != 0xff)
-    return false;
-  if (mem[WRAP(pos + 1)] != 0)
-    return false;
-  if (mem[WRAP(pos + 2)] != 0)
-    return false;
+// CRC-8 with polynomial x^8 + x^2 + x + 1, table is built at compile time
+struct Crc8Table {
+  uint8_t value[256];
+
+  constexpr Crc8Table() : value() {
+    for (int i = 0; i < 256; ++i) {
+      uint8_t crc = i;
+      for (int bit = 0; bit < 8; ++bit)
+        crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+      value[i] = crc;
+    }
+  }
+};
+
+constexpr Crc8Table crc8_table;
+
+uint8_t crc8(uint8_t crc, uint8_t byte) { return crc8_table.value[crc ^ byte]; }
+
+uint8_t crc8(uint8_t crc, const uint8_t *buffer, int len) {
+  for (int i = 0; i < len; ++i)
+    crc = crc8(crc, buffer[i]);
+  return crc;
+}
+
+uint8_t crc8(uint8_t crc, MemoryWindow &window, int from, int to) {
+  for (int addr = from; addr < to; ++addr)
+    crc = crc8(crc, window[addr]);
+  return crc;
+}
+
+uint32_t zigzag(int value) {
+  return (static_cast<uint32_t>(value) << 1) ^ (value < 0 ? ~0u : 0u);
+}
+
+int unzigzag(uint32_t value) {
+  return static_cast<int>((value >> 1) ^ (~(value & 1) + 1));
+}
+
+uint8_t *putVarint(uint8_t *buffer, uint32_t value) {
+  while (value >= 0x80) {
+    *buffer++ = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  *buffer++ = value;
+  return buffer;
+}
+
+// returns false if varint does not end before limit
+bool getVarint(MemoryWindow &window, int &addr, int limit, uint32_t &value) {
+  value = 0;
+  for (int i = 0; i < max_varint_size && addr < limit; ++i) {
+    uint8_t byte = window[addr++];
+    value |= static_cast<uint32_t>(byte & 0x7f) << (7 * i);
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+uint8_t *putU32(uint8_t *buffer, uint32_t value) {
+  for (int i = 0; i < 4; ++i)
+    *buffer++ = (value >> (8 * i)) & 0xff;
+  return buffer;
+}
+
+uint32_t getU32(MemoryWindow &window, int addr) {
+  uint32_t value = 0;
+  for (int i = 0; i < 4; ++i)
+    value |= static_cast<uint32_t>(window[addr + i]) << (8 * i);
+  return value;
+}
+
+uint8_t seqCrc(uint32_t seq) {
+  uint8_t seq_bytes[seq_size];
+  putU32(seq_bytes, seq);
+  return crc8(crc_init, seq_bytes, seq_size);
+}
+
+uint8_t *putCheckpoint(uint8_t *buffer, const PersistentState::Checkpoint &cp) {
+  uint8_t *end = putVarint(buffer, cp.events);
+  end = putVarint(end, zigzag(cp.value));
+  end = putVarint(end, cp.history_items);
+  end = putVarint(end, cp.session_items);
+  end = putVarint(end, cp.history_records);
+  end = putVarint(end, cp.time);
+  return putVarint(end, cp.sessions);
+}
+
+// returns false if the checkpoint does not end before limit
+bool getCheckpoint(MemoryWindow &window, int &addr, int limit,
+                   PersistentState::Checkpoint &cp) {
+  uint32_t fields[checkpoint_fields];
+  for (uint32_t &field : fields)
+    if (!getVarint(window, addr, limit, field))
+      return false;
+  cp.events = fields[0];
+  cp.value = unzigzag(fields[1]);
+  cp.history_items = fields[2];
+  cp.session_items = fields[3];
+  cp.history_records = fields[4];
+  cp.time = fields[5];
+  cp.sessions = fields[6];
   return true;
 }
-} // namespace
 
-void PersistentState::putEndMark(int offset) {
-  int mem_size = mem->size();
-  assert(offset >= 0 && offset < mem_size);
-  for (int i = 0; i < end_mark_size; ++i) {
-    int rep_offset = WRAP(offset + i);
-    switch (mem->read(rep_offset)) {
-    case 1:
-      for (int j = 0; j < 3; ++j)
-        mem->write(WRAP(rep_offset + j), 0);
-      break;
-    default:
-      mem->write(rep_offset, 0);
-      break;
+// returns size of the header
+int putPageHeader(uint8_t *buffer, uint32_t seq,
+                  const PersistentState::Checkpoint &cp) {
+  uint8_t *end = putCheckpoint(putU32(buffer, seq), cp);
+  *end = crc8(crc_init, buffer, end - buffer);
+  return end + crc_size - buffer;
+}
+
+// returns size of the record without crc
+int putNewValueRecord(uint8_t *buffer, int delta) {
+  uint32_t encoded_delta = zigzag(delta);
+  if (encoded_delta < short_delta_flag) {
+    buffer[0] = short_delta_flag | encoded_delta;
+    return 1;
+  }
+  buffer[0] = new_value_record;
+  return putVarint(buffer + 1, encoded_delta) - buffer;
+}
+
+void applyNewValue(PersistentState::Checkpoint &cp, int value) {
+  cp.value = value;
+  cp.history_items++;
+  cp.session_items++;
+  cp.history_records++;
+}
+
+void applyClearHistory(PersistentState::Checkpoint &cp) {
+  cp.value = 0;
+  cp.history_items = 0;
+  cp.session_items = 0;
+  cp.history_records = 0;
+}
+
+void applyNewCount(PersistentState::Checkpoint &cp) {
+  cp.value = 0;
+  cp.session_items = 0;
+  cp.history_records++;
+  cp.sessions++;
+}
+
+// returns size of the record without crc, time is not before the
+// checkpoint
+int putEventRecord(uint8_t *buffer, uint8_t record_type, int value,
+                   uint32_t time, const PersistentState::Checkpoint &cp) {
+  int len = 1;
+  if (record_type == new_value_record)
+    len = putNewValueRecord(buffer, value - cp.value);
+  else
+    buffer[0] = record_type;
+  return putVarint(buffer + len, time - cp.time) - buffer;
+}
+
+// record is either of the given type or a new value
+void replayRecord(PersistentState::Checkpoint &cp, uint8_t record_type,
+                  int delta, uint32_t elapsed,
+                  const std::function<void(int, int)> &onChange,
+                  const std::function<void()> &onClearHistory,
+                  const std::function<void()> &onNewCount) {
+  cp.time += elapsed;
+  if (record_type == clear_history_record) {
+    applyClearHistory(cp);
+    if (onClearHistory)
+      onClearHistory();
+  } else if (record_type == new_count_record) {
+    applyNewCount(cp);
+    if (onNewCount)
+      onNewCount();
+  } else {
+    applyNewValue(cp, cp.value + delta);
+    if (onChange)
+      onChange(cp.value, delta);
+  }
+  cp.events++;
+}
+
+// bits are packed from the least significant bit of a byte
+class BitWriter {
+  uint8_t data[max_archive_block_data];
+  int count = 0;
+
+public:
+  void put(uint32_t value, int bits) {
+    assert(count + bits <= max_archive_block_data * 8);
+    for (int i = 0; i < bits; ++i, ++count) {
+      if (count % 8 == 0)
+        data[count / 8] = 0;
+      if ((value >> i) & 1)
+        data[count / 8] |= 1 << (count % 8);
     }
   }
-  mem->write(offset, 0xff);
-  mem->write(WRAP(offset + 1), 0x00);
-  mem->write(WRAP(offset + 2), 0x00);
+
+  void putRice(uint32_t value, int k) {
+    uint32_t q = value >> k;
+    if (q >= rice_escape) {
+      put((1u << rice_escape) - 1, rice_escape);
+      put(value, 32);
+      return;
+    }
+    put((1u << q) - 1, q);
+    put(0, 1);
+    put(value, k);
+  }
+
+  void clear() { count = 0; }
+
+  int bits() const { return count; }
+  const uint8_t *bytes() const { return data; }
+  int size() const { return (count + 7) / 8; }
+};
+
+class BitReader {
+  MemoryWindow &window;
+  int addr;
+  const int end;
+  int bit = 0;
+
+public:
+  BitReader(MemoryWindow &window, int addr, int end)
+      : window(window), addr(addr), end(end) {}
+
+  // address of the byte holding the next bit
+  int address() const { return addr; }
+
+  // returns false if the data ends before
+  bool get(int bits, uint32_t &value) {
+    value = 0;
+    for (int i = 0; i < bits; ++i) {
+      if (addr >= end)
+        return false;
+      if ((window[addr] >> bit) & 1)
+        value |= 1u << i;
+      if (++bit == 8) {
+        bit = 0;
+        addr++;
+      }
+    }
+    return true;
+  }
+
+  bool getRice(int k, uint32_t &value) {
+    uint32_t q = 0;
+    for (uint32_t one = 1; one;) {
+      if (!get(1, one))
+        return false;
+      if (one && ++q == rice_escape)
+        return get(32, value);
+    }
+    uint32_t low = 0;
+    if (!get(k, low))
+      return false;
+    value = q << k | low;
+    return true;
+  }
+};
+
+int riceBits(uint32_t value, int k) {
+  uint32_t q = value >> k;
+  return q >= rice_escape ? max_rice_bits : q + 1 + k;
+}
+
+int archivedRecordBits(uint8_t record_type, int delta, uint32_t elapsed,
+                       int k_delta, int k_time) {
+  int bits = record_type == new_value_record
+                 ? 1 + riceBits(zigzag(delta), k_delta)
+                 : 2;
+  return bits + riceBits(elapsed, k_time);
+}
+
+void putArchivedRecord(BitWriter &writer, uint8_t record_type, int delta,
+                       uint32_t elapsed, int k_delta, int k_time) {
+  if (record_type == new_value_record) {
+    writer.put(0, 1);
+    writer.putRice(zigzag(delta), k_delta);
+  } else {
+    writer.put(1, 1);
+    writer.put(record_type == new_count_record, 1);
+  }
+  writer.putRice(elapsed, k_time);
+}
+
+// returns size of the block without data and crc, block continuing
+// the previous one does not repeat the checkpoint
+int putArchiveBlockHeader(uint8_t *buffer,
+                          const PersistentState::Checkpoint *cp,
+                          uint32_t records, int len) {
+  uint8_t *end = buffer;
+  *end++ = cp ? archive_block_mark : archive_continue_mark;
+  if (cp)
+    end = putCheckpoint(end, *cp);
+  end = putVarint(end, records);
+  end = putVarint(end, len);
+  return end - buffer;
+}
+
+// returns block mark, 0 if there is no valid block, on success addr points
+// to the block data and cp is set to the block start if it is stored
+uint8_t readArchiveBlock(MemoryWindow &window, int &addr, int limit,
+                         uint8_t crc_seed, PersistentState::Checkpoint &cp,
+                         uint32_t &records, uint32_t &len) {
+  const int start = addr;
+  if (addr >= limit)
+    return 0;
+  const uint8_t mark = window[addr++];
+  PersistentState::Checkpoint block;
+  if (mark == archive_block_mark && !getCheckpoint(window, addr, limit, block))
+    return 0;
+  if ((mark != archive_block_mark && mark != archive_continue_mark) ||
+      !getVarint(window, addr, limit, records) ||
+      !getVarint(window, addr, limit, len) ||
+      len >= static_cast<uint32_t>(limit - addr) ||
+      window[addr + len] != crc8(crc_seed, window, start, addr + len))
+    return 0;
+  if (mark == archive_block_mark)
+    cp = block;
+  return mark;
+}
+
+// head of a ring of pages with consecutive sequence numbers, -1 if the ring
+// is empty, first is set to the page the ring starts from
+int findRingHead(int pages, const std::function<uint32_t(int)> &seqAt,
+                 int &first) {
+  // torn page 0 means the ring has just wrapped, it starts at page 1 then
+  first = seqAt(0) != 0 ? 0 : 1;
+  uint32_t first_seq = seqAt(first);
+  if (first_seq == 0)
+    return -1;
+  // pages [first, head] have sequence numbers not less than the first page,
+  // pages after head are either unused, torn or left from previous lap
+  int lo = first;
+  int hi = pages - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (seqAt(mid) >= first_seq)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+// number of pages continuing the ring back from the head, they form
+// a contiguous part of the ring
+int ringChain(int pages, int head, uint32_t seq,
+              const std::function<uint32_t(int)> &seqAt) {
+  int lo = 1;
+  int hi = pages;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    int page = (head - mid + 1 + pages) % pages;
+    if (seq >= static_cast<uint32_t>(mid) && seqAt(page) == seq - mid + 1)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+void applyEvent(PersistentState::Checkpoint &cp, uint8_t record_type,
+                int value, uint32_t time) {
+  cp.time = time;
+  if (record_type == new_value_record)
+    applyNewValue(cp, value);
+  else if (record_type == clear_history_record)
+    applyClearHistory(cp);
+  else
+    applyNewCount(cp);
+  cp.events++;
+}
+} // namespace
+
+int PersistentState::readPageHeader(int page, MemoryWindow &window,
+                                    uint32_t &seq, Checkpoint &cp) const {
+  const int base = page * page_size;
+  const int limit = base + page_size;
+  seq = getU32(window, base);
+  int addr = base + seq_size;
+  Checkpoint read;
+  if (seq == 0 || !getCheckpoint(window, addr, limit, read) ||
+      addr >= limit || window[addr] != crc8(crc_init, window, base, addr)) {
+    seq = 0;
+    return 0;
+  }
+  cp = read;
+  return addr + crc_size - base;
+}
+
+uint32_t PersistentState::readPageSeq(int page, MemoryWindow &window) const {
+  uint32_t seq = 0;
+  Checkpoint cp;
+  readPageHeader(page, window, seq, cp);
+  return seq;
+}
+
+int PersistentState::findHeadPage(MemoryWindow &window, int &first) const {
+  return findRingHead(
+      pageCount(), [&](int page) { return readPageSeq(page, window); },
+      first);
+}
+
+void PersistentState::format() {
+  const int pages = pageCount();
+  uint8_t header[max_page_header_size + 1] = {0};
+  for (int page = 1; page < pages; ++page) {
+    mem->erase(page * page_size, page_size);
+    mem->writeBlock(page * page_size, header, seq_size);
+  }
+  for (int page = 0; page < archive_pages; ++page)
+    mem->writeBlock(archivePageAddr(page), header, seq_size);
+  resetArchive();
+  mem->erase(0, page_size);
+  state = Checkpoint();
+  int header_size = putPageHeader(header, 1, state);
+  header[header_size] = end_of_page;
+  mem->writeBlock(0, header, header_size + 1);
+  head_page = 0;
+  head_seq = 1;
+  sequence_end = header_size;
+  time_base = 0;
+}
+
+int PersistentState::replayPage(int page, uint32_t seq, int offset,
+                                MemoryWindow &window, Checkpoint &cp,
+                                const std::function<void(int, int)> &onChange,
+                                const std::function<void()> &onClearHistory,
+                                const std::function<void()> &onNewCount,
+                                const std::function<void(int)> &onRecordStart) {
+  const int base = page * page_size;
+  const int limit = base + page_size;
+  const uint8_t crc_seed = seqCrc(seq);
+  int addr = base + offset;
+  while (addr < limit) {
+    const int record_start = addr;
+    uint8_t record_type = window[addr++];
+    uint32_t encoded_delta = 0;
+    if (record_type & short_delta_flag)
+      encoded_delta = record_type & ~short_delta_flag;
+    else if (record_type == new_value_record) {
+      if (!getVarint(window, addr, limit, encoded_delta))
+        return record_start - base;
+    } else if (record_type != clear_history_record &&
+               record_type != new_count_record)
+      // end of records or garbage
+      return record_start - base;
+    uint32_t elapsed = 0;
+    if (!getVarint(window, addr, limit, elapsed) || addr >= limit ||
+        window[addr] != crc8(crc_seed, window, record_start, addr))
+      // torn or stale record
+      return record_start - base;
+    addr += crc_size;
+
+    if (onRecordStart)
+      onRecordStart(record_start);
+    replayRecord(cp, record_type, unzigzag(encoded_delta), elapsed, onChange,
+                 onClearHistory, onNewCount);
+  }
+  return addr - base;
+}
+
+void PersistentState::setupLayout() {
+  const int pages = mem->size() / page_size;
+  // flash pages could not be appended after erase of the archive head
+  archive_pages =
+      mem->eraseSize() == 1 && pages >= min_pages_for_archive ? pages / 2 : 0;
+}
+
+int PersistentState::openLog() {
+  setupLayout();
+  const int pages = pageCount();
+  assert(pages >= 2 && (pages + archive_pages) * page_size == mem->size());
+  assert(page_size >= max_page_header_size + max_record_size);
+  assert(page_size % mem->eraseSize() == 0);
+  assert(archive_pages == 0 ||
+         (page_size >= archive_header_size + max_archive_block_header_size +
+                           1 + max_archive_record_size + crc_size &&
+          page_size <= max_archive_page_size));
+
+  MemoryWindow window(mem);
+  int first_page = 0;
+  head_page = findHeadPage(window, first_page);
+  if (head_page < 0) {
+    // no valid page found, start new log
+    format();
+    return -1;
+  }
+  openArchive(window);
+  // find current state and end of the log
+  int offset = readPageHeader(head_page, window, head_seq, state);
+  int end = replayPage(head_page, head_seq, offset, window, state, nullptr,
+                       nullptr, nullptr);
+  sequence_end = head_page * page_size + end;
+  time_base = state.time;
+  if (mem->eraseSize() > 1) {
+    // bytes after the end could be partially programmed by interrupted
+    // append, they can not be overwritten, so the page is closed
+    for (int addr = sequence_end; addr < (head_page + 1) * page_size; ++addr)
+      if (window[addr] != end_of_page) {
+        sequence_end = (head_page + 1) * page_size;
+        break;
+      }
+  } else if (end < page_size && window[sequence_end] != end_of_page)
+    // drop torn record
+    mem->writeBlock(sequence_end, &end_of_page, 1);
+  // pages after head are the oldest ones, if they are left from previous lap,
+  // page right after head could be torn
+  for (int i = 1; i <= 2 && head_page + i < pages; ++i) {
+    uint32_t seq = readPageSeq(head_page + i, window);
+    if (seq != 0 && seq + pages - i == head_seq)
+      return head_page + i;
+  }
+  return first_page;
 }
 
 void PersistentState::restoreFromMem(std::function<void(int, int)> onChange,
                                      std::function<void()> onClearHistory,
                                      std::function<void()> onNewCount) {
+  restoreFrom(false, 0, nullptr, onChange, onClearHistory, onNewCount);
+}
+
+void PersistentState::restoreFromMem(
+    int min_events, std::function<void(const Checkpoint &)> onCheckpoint,
+    std::function<void(int, int)> onChange,
+    std::function<void()> onClearHistory, std::function<void()> onNewCount) {
+  restoreFrom(true, min_events, onCheckpoint, onChange, onClearHistory,
+              onNewCount);
+}
+
+void PersistentState::restoreFrom(
+    bool visible_only, int min_events,
+    const std::function<void(const Checkpoint &)> &onCheckpoint,
+    const std::function<void(int, int)> &onChange,
+    const std::function<void()> &onClearHistory,
+    const std::function<void()> &onNewCount) {
   if (!mem->isValid())
     return;
-  int mem_size = mem->size();
-  std::unique_ptr<uint8_t[]> buffer{new uint8_t[mem_size]};
+  flush();
+  if (openLog() < 0)
+    return;
+  // values after the last history clear or new count are the only visible
+  // records, checkpoints tell how many of them there are, so replay starts
+  // right after the marker without decoding anything before it
+  uint32_t first = 0;
+  if (visible_only)
+    first = state.events -
+            std::min(static_cast<uint32_t>(std::max(min_events, 0)),
+                     static_cast<uint32_t>(state.session_items));
+  // search for the newest page starting not after the first record goes
+  // back from the head with growing steps, as the tail is usually short,
+  // pages are addressed by distance back from the head
+  const int pages = pageCount();
+  MemoryWindow window(mem);
+  auto pageAt = [&](int distance) {
+    return (head_page - distance + pages) % pages;
+  };
+  uint32_t seq = 0;
+  Checkpoint cp;
+  auto inLog = [&](int distance) {
+    if (distance >= pages || static_cast<uint32_t>(distance) >= head_seq)
+      return false;
+    readPageHeader(pageAt(distance), window, seq, cp);
+    return seq == head_seq - distance;
+  };
+  auto startsAfter = [&](int distance) {
+    return inLog(distance) && cp.events > first;
+  };
+  int lo = 0; // pages closer than lo start after the first record
+  int hi = 0;
+  for (int step = 1; startsAfter(hi); step *= 2) {
+    lo = hi + 1;
+    hi += step;
+  }
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (startsAfter(mid))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  // log could start after the first record
+  if (!inLog(lo))
+    lo--;
 
-  for (int i = 0; i < mem_size; ++i)
-    buffer[i] = mem->read(i);
+  // records before the first one are replayed silently
+  bool started = false;
+  auto start = [&]() {
+    if (!started && cp.events >= first) {
+      started = true;
+      if (onCheckpoint)
+        onCheckpoint(cp);
+    }
+  };
+  auto visible = [&]() { return cp.events >= first; };
+  for (int distance = lo; distance >= 0; --distance) {
+    int offset = readPageHeader(pageAt(distance), window, seq, cp);
+    start();
+    replayPage(
+        pageAt(distance), seq, offset, window, cp,
+        [&](int value, int delta) {
+          if (visible() && onChange)
+            onChange(value, delta);
+        },
+        [&]() {
+          if (visible() && onClearHistory)
+            onClearHistory();
+        },
+        [&]() {
+          if (visible() && onNewCount)
+            onNewCount();
+        },
+        [&](int) { start(); });
+  }
+  start();
+}
 
-  // find zero
-  // consider zero as a sequence start replaying events
-  sequence_end = -1;
-  for (int i = 0; i < mem_size; ++i)
-    if (isEndMark(buffer.get(), i, mem_size)) {
-      sequence_end = i;
-      break;
+int PersistentState::logPages(MemoryWindow &window, int head,
+                               uint32_t seq) const {
+  return ringChain(pageCount(), head, seq,
+                   [&](int page) { return readPageSeq(page, window); });
+}
+
+uint32_t PersistentState::oldestEvent(MemoryWindow &window) const {
+  const int pages = pageCount();
+  int oldest_page =
+      (head_page - logPages(window, head_page, head_seq) + 1 + pages) % pages;
+  uint32_t seq = 0;
+  Checkpoint oldest;
+  readPageHeader(oldest_page, window, seq, oldest);
+  Checkpoint archived;
+  if (readArchiveStart(window, archived) && archive_events >= oldest.events)
+    oldest = archived;
+  return oldest.events;
+}
+
+int PersistentState::historySize() {
+  if (!mem->isValid())
+    return 0;
+  flush();
+  if (head_seq == 0)
+    openLog();
+  MemoryWindow window(mem);
+  uint32_t available = state.events - oldestEvent(window);
+  return std::min(available, state.history_records);
+}
+
+void PersistentState::replayFrom(
+    const std::function<bool(const Checkpoint &)> &before,
+    const std::function<bool()> &done, MemoryWindow &window, Checkpoint &cp,
+    const std::function<void(int, int)> &onChange,
+    const std::function<void()> &onClearHistory,
+    const std::function<void()> &onNewCount,
+    const std::function<void(int)> &onRecordStart) {
+  // binary search for the newest page starting before the wanted point,
+  // pages are addressed by distance back from the head
+  auto searchPages = [&](int pages, const std::function<void(int)> &readAt) {
+    int lo = 0;
+    int hi = pages - 1;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      readAt(mid);
+      if (before(cp))
+        hi = mid;
+      else
+        lo = mid + 1;
     }
-  if (sequence_end == -1) {
-    // mem is in inconsistent state, initialize with zeros
-    putEndMark(0);
-    for (int i = 3; i < mem_size; ++i)
-      mem->write(i, 0);
-    sequence_end = 0;
-    return;
-  }
-  assert(sequence_end >= 0 && sequence_end < mem_size);
-  int value = 0;
-  for (int offset = 3; offset < mem_size;) {
-    auto commandId = buffer[WRAP(sequence_end + offset)];
-    // 1 add new number
-    // 2 clear history
-    // 3 start new count
-    // all others are ignored
-    switch (commandId) {
-    case 1: {
-      int16_t new_value = buffer[WRAP(sequence_end + offset + 1)] |
-                          (buffer[WRAP(sequence_end + offset + 2)] << 8);
-      int delta = new_value - value;
-      value = new_value;
-      onChange(new_value, delta);
-      offset += 3;
-      break;
+    return lo;
+  };
+
+  const int pages = pageCount();
+  auto pageAt = [&](int distance) {
+    return (head_page - distance + pages) % pages;
+  };
+  const int log_pages = logPages(window, head_page, head_seq);
+  uint32_t seq = 0;
+  readPageHeader(pageAt(log_pages - 1), window, seq, cp);
+  // the archive continues to the log start
+  if (!before(cp) && readArchiveStart(window, cp)) {
+    const int archived = archiveChain(window);
+    auto archivePageAt = [&](int distance) {
+      return (archive_head - distance + archive_pages) % archive_pages;
+    };
+    int lo = searchPages(archived, [&](int distance) {
+      const int base = archivePageAddr(archivePageAt(distance));
+      int addr = base + archive_header_size;
+      uint32_t records = 0;
+      uint32_t len = 0;
+      readArchiveBlock(window, addr, base + page_size,
+                       seqCrc(archive_seq - distance), cp, records, len);
+    });
+    for (int distance = lo; distance >= 0; --distance) {
+      replayArchivePage(archivePageAt(distance), window, cp, onChange,
+                        onClearHistory, onNewCount, onRecordStart);
+      if (done())
+        return;
     }
-    case 2:
-      onClearHistory();
-      value = 0;
-      offset++;
-      break;
-    case 3:
-      onNewCount();
-      value = 0;
-      offset++;
-      break;
-    default:
-      value = 0;
-      offset++;
+  }
+
+  // the archive could still have the log start, so the log could
+  // repeat some records
+  int lo = searchPages(log_pages, [&](int distance) {
+    readPageHeader(pageAt(distance), window, seq, cp);
+  });
+  for (int distance = lo; distance >= 0; --distance) {
+    int offset = readPageHeader(pageAt(distance), window, seq, cp);
+    replayPage(pageAt(distance), seq, offset, window, cp, onChange,
+               onClearHistory, onNewCount, onRecordStart);
+    if (done())
+      return;
+  }
+}
+
+void PersistentState::replayRange(
+    uint32_t from, uint32_t to, MemoryWindow &window, Checkpoint &cp,
+    const std::function<void(int, int)> &onChange,
+    const std::function<void()> &onClearHistory,
+    const std::function<void()> &onNewCount,
+    const std::function<void(int)> &onRecordStart) {
+  replayFrom([&](const Checkpoint &c) { return c.events <= from; },
+             [&]() { return cp.events >= to; }, window, cp, onChange,
+             onClearHistory, onNewCount, onRecordStart);
+}
+
+void PersistentState::readHistory(
+    int first, int count,
+    std::function<void(int, const HistoryRecord &)> onRecord) {
+  const int size = historySize();
+  first = std::max(first, 0);
+  count = std::min(count, size - first);
+  if (count <= 0)
+    return;
+  const uint32_t history_start = state.events - size;
+  const uint32_t from = history_start + first;
+  const uint32_t to = from + count;
+  // records repeated by the log are emitted once
+  uint32_t next = from;
+  Checkpoint cp;
+  uint32_t previous_time = 0;
+  // cp.events is the number of the record being replayed
+  auto emit = [&](bool new_count, int value, int delta) {
+    if (cp.events >= next && cp.events < to) {
+      onRecord(cp.events - history_start,
+               {new_count, value, delta, cp.history_items, cp.time,
+                cp.time - previous_time});
+      next = cp.events + 1;
+    }
+  };
+  MemoryWindow window(mem);
+  replayRange(
+      from, to, window, cp,
+      [&](int value, int delta) { emit(false, value, delta); }, nullptr,
+      [&]() { emit(true, 0, 0); }, [&](int) { previous_time = cp.time; });
+}
+
+bool PersistentState::stateAt(uint32_t events, Checkpoint &cp) {
+  if (!mem->isValid())
+    return false;
+  flush();
+  if (head_seq == 0)
+    openLog();
+  if (events >= state.events) {
+    cp = state;
+    return events == state.events;
+  }
+  // state before the record is the state after the records preceding it,
+  // records older than the log and the archive are never found
+  MemoryWindow window(mem);
+  bool found = false;
+  Checkpoint replayed;
+  replayRange(events, events + 1, window, replayed, nullptr, nullptr, nullptr,
+              [&](int) {
+                if (!found && replayed.events == events) {
+                  cp = replayed;
+                  found = true;
+                }
+              });
+  return found;
+}
+
+bool PersistentState::sessionStartState(uint32_t number, Checkpoint &cp) {
+  Session session;
+  // the new count record is included
+  return findSession(number, session) && stateAt(session.events + 1, cp);
+}
+
+uint32_t PersistentState::eventCount() {
+  if (!mem->isValid())
+    return 0;
+  flush();
+  if (head_seq == 0)
+    openLog();
+  return state.events;
+}
+
+int PersistentState::replayLog(
+    uint32_t first, int count, Checkpoint &start,
+    std::function<void(LogRecord::Opcode, int, uint32_t)> onRecord) {
+  start = Checkpoint();
+  const uint32_t events = eventCount();
+  if (!mem->isValid())
+    return 0;
+  MemoryWindow window(mem);
+  first = std::max(first, oldestEvent(window));
+  start = state;
+  if (first >= events || count <= 0)
+    return 0;
+  const uint32_t to = first + std::min<uint32_t>(count, events - first);
+  // records repeated by the log are replayed once
+  uint32_t next = first;
+  Checkpoint cp;
+  auto emit = [&](LogRecord::Opcode opcode, int delta) {
+    if (cp.events >= next && cp.events < to) {
+      onRecord(opcode, delta, cp.time);
+      next = cp.events + 1;
+    }
+  };
+  replayRange(
+      first, to, window, cp,
+      [&](int, int delta) { emit(LogRecord::new_value, delta); },
+      [&]() { emit(LogRecord::clear_history, 0); },
+      [&]() { emit(LogRecord::new_count, 0); },
+      [&](int) {
+        if (cp.events == first && next == first)
+          start = cp;
+      });
+  return next - first;
+}
+
+uint32_t PersistentState::lastSession() {
+  if (!mem->isValid())
+    return 0;
+  flush();
+  if (head_seq == 0)
+    openLog();
+  return state.sessions;
+}
+
+bool PersistentState::findSession(uint32_t number, Session &session) {
+  if (number == 0 || number > lastSession())
+    return false;
+  // the newest checkpoint before the session start is found with binary
+  // search, then its new count is replayed
+  MemoryWindow window(mem);
+  bool found = false;
+  int previous_value = 0;
+  Checkpoint cp;
+  replayFrom([&](const Checkpoint &c) { return c.sessions < number; },
+             [&]() { return found; }, window, cp, nullptr, nullptr,
+             [&]() {
+               if (!found && cp.sessions == number) {
+                 session = {number, cp.events, previous_value};
+                 found = true;
+               }
+             },
+             [&](int) { previous_value = cp.value; });
+  return found;
+}
+
+int PersistentState::sessionHistoryRow(const Session &session) {
+  const int size = historySize();
+  const uint32_t history_start = state.events - size;
+  if (session.events < history_start || session.events >= state.events)
+    return -1;
+  return session.events - history_start;
+}
+
+uint32_t PersistentState::readArchiveSeq(int page,
+                                         MemoryWindow &window) const {
+  const int addr = archivePageAddr(page);
+  uint32_t seq = getU32(window, addr);
+  return window[addr + seq_size] == seqCrc(seq) ? seq : 0;
+}
+
+int PersistentState::archiveChain(MemoryWindow &window) const {
+  if (archive_seq == 0)
+    return 0;
+  return ringChain(archive_pages, archive_head, archive_seq, [&](int page) {
+    return readArchiveSeq(page, window);
+  });
+}
+
+bool PersistentState::readArchiveStart(MemoryWindow &window,
+                                       Checkpoint &cp) const {
+  const int chain = archiveChain(window);
+  if (chain == 0)
+    return false;
+  const int page = (archive_head - chain + 1 + archive_pages) % archive_pages;
+  int addr = archivePageAddr(page) + archive_header_size;
+  uint32_t records = 0;
+  uint32_t len = 0;
+  return readArchiveBlock(window, addr, archivePageAddr(page) + page_size,
+                          seqCrc(archive_seq - chain + 1), cp, records,
+                          len) == archive_block_mark;
+}
+
+void PersistentState::resetArchive() {
+  // the first block starts a new page
+  archive_head = archive_pages - 1;
+  archive_seq = 0;
+  archive_end = archivePageAddr(archive_head) + page_size;
+  archive_events = 0;
+}
+
+void PersistentState::openArchive(MemoryWindow &window) {
+  resetArchive();
+  if (archive_pages == 0)
+    return;
+  int first_page = 0;
+  int head = findRingHead(
+      archive_pages, [&](int page) { return readArchiveSeq(page, window); },
+      first_page);
+  if (head < 0)
+    return;
+  archive_head = head;
+  archive_seq = readArchiveSeq(head, window);
+  // torn block after the last one is overwritten by the next block
+  const int limit = archivePageAddr(head) + page_size;
+  archive_end = archivePageAddr(head) + archive_header_size;
+  for (;;) {
+    int addr = archive_end;
+    Checkpoint cp;
+    uint32_t records = 0;
+    uint32_t len = 0;
+    uint8_t mark = readArchiveBlock(window, addr, limit, seqCrc(archive_seq),
+                                    cp, records, len);
+    if (!mark)
       break;
+    if (mark == archive_block_mark)
+      archive_events = cp.events;
+    archive_end = addr + len + crc_size;
+    archive_events += records;
+  }
+}
+
+bool PersistentState::archiveContinues(const Checkpoint &start) const {
+  // the first block of a page always has the checkpoint
+  return archive_end > archivePageAddr(archive_head) + archive_header_size &&
+         start.events == archive_events;
+}
+
+int PersistentState::archiveRoom() const {
+  const int base = archivePageAddr(archive_head);
+  return base + page_size - archive_end -
+         (archive_end == base ? archive_header_size : 0);
+}
+
+void PersistentState::startArchivePage() {
+  archive_head = (archive_head + 1) % archive_pages;
+  archive_seq++;
+  archive_end = archivePageAddr(archive_head);
+}
+
+void PersistentState::writeArchiveBlock(const Checkpoint &start,
+                                        uint32_t records,
+                                        const uint8_t *data, int len) {
+  uint8_t buffer[archive_header_size + max_archive_block_header_size +
+                 max_archive_block_data + crc_size + 1];
+  uint8_t *end = buffer;
+  if (archive_end == archivePageAddr(archive_head)) {
+    end = putU32(end, archive_seq);
+    *end++ = seqCrc(archive_seq);
+  }
+  uint8_t *block = end;
+  end += putArchiveBlockHeader(end, archiveContinues(start) ? nullptr : &start,
+                               records, len);
+  end = std::copy(data, data + len, end);
+  *end = crc8(seqCrc(archive_seq), block, end - block);
+  end += crc_size;
+  const int size = end - buffer;
+  writeBatch(archive_end, buffer, size);
+  archive_end += size;
+  archive_events = start.events + records;
+}
+
+void PersistentState::archiveLogPage(int page) {
+  if (archive_pages == 0)
+    return;
+  MemoryWindow window(mem);
+  uint32_t seq = 0;
+  Checkpoint page_start;
+  int offset = readPageHeader(page, window, seq, page_start);
+  // only the log start is archived, not pages left from older laps
+  if (offset == 0 || seq + pageCount() != head_seq)
+    return;
+  // page is replayed twice, Rice parameters are chosen for all of its
+  // records first, then records are packed, so none of them is kept
+  Checkpoint cp;
+  Checkpoint record_start;
+  auto replay = [&](const auto &onRecord) {
+    cp = page_start;
+    replayPage(
+        page, seq, offset, window, cp,
+        [&](int, int delta) { onRecord(new_value_record, delta); },
+        [&]() { onRecord(clear_history_record, 0); },
+        [&]() { onRecord(new_count_record, 0); },
+        [&](int) { record_start = cp; });
+  };
+  // records archived before power cut are not repeated
+  auto archived = [&]() { return record_start.events < archive_events; };
+
+  int records = 0;
+  long delta_bits[max_rice_k + 1] = {};
+  long time_bits[max_rice_k + 1] = {};
+  replay([&](uint8_t record_type, int delta) {
+    if (archived())
+      return;
+    records++;
+    for (int k = 0; k <= max_rice_k; ++k) {
+      if (record_type == new_value_record)
+        delta_bits[k] += riceBits(zigzag(delta), k);
+      time_bits[k] += riceBits(cp.time - record_start.time, k);
+    }
+  });
+  if (records == 0)
+    return;
+  const int k_delta =
+      std::min_element(delta_bits, delta_bits + max_rice_k + 1) - delta_bits;
+  const int k_time =
+      std::min_element(time_bits, time_bits + max_rice_k + 1) - time_bits;
+
+  // block is written when the next record does not fit the archive page
+  // or the buffer
+  BitWriter data;
+  Checkpoint block_start;
+  uint32_t block_records = 0;
+  auto blockFits = [&](const Checkpoint &start, uint32_t count, int bits) {
+    uint8_t header[max_archive_block_header_size];
+    int size = putArchiveBlockHeader(
+        header, archiveContinues(start) ? nullptr : &start, count, 0);
+    return bits <= max_archive_block_data * 8 &&
+           size + (bits + 7) / 8 + crc_size <= archiveRoom();
+  };
+  auto writeBlock = [&]() {
+    writeArchiveBlock(block_start, block_records, data.bytes(), data.size());
+    block_records = 0;
+  };
+  replay([&](uint8_t record_type, int delta) {
+    if (archived())
+      return;
+    const uint32_t elapsed = cp.time - record_start.time;
+    const int bits =
+        archivedRecordBits(record_type, delta, elapsed, k_delta, k_time);
+    if (block_records > 0 &&
+        !blockFits(block_start, block_records + 1, data.bits() + bits))
+      writeBlock();
+    if (block_records == 0) {
+      block_start = record_start;
+      data.clear();
+      data.put(k_delta | k_time << 4, 8);
+      if (!blockFits(block_start, 1, data.bits() + bits))
+        startArchivePage();
     }
+    putArchivedRecord(data, record_type, delta, elapsed, k_delta, k_time);
+    block_records++;
+  });
+  writeBlock();
+}
+
+int PersistentState::replayArchivePage(
+    int page, MemoryWindow &window, Checkpoint &cp,
+    const std::function<void(int, int)> &onChange,
+    const std::function<void()> &onClearHistory,
+    const std::function<void()> &onNewCount,
+    const std::function<void(int)> &onRecordStart) {
+  const int limit = archivePageAddr(page) + page_size;
+  const uint8_t crc_seed = seqCrc(readArchiveSeq(page, window));
+  int block = archivePageAddr(page) + archive_header_size;
+  for (;;) {
+    int addr = block;
+    uint32_t records = 0;
+    uint32_t len = 0;
+    if (!readArchiveBlock(window, addr, limit, crc_seed, cp, records, len))
+      return block;
+    BitReader bits(window, addr, addr + len);
+    uint32_t params = 0;
+    if (!bits.get(8, params))
+      return block;
+    const int k_delta = params & 0xf;
+    const int k_time = params >> 4;
+    for (uint32_t i = 0; i < records; ++i) {
+      const int record_start = bits.address();
+      uint32_t flag = 0;
+      uint32_t encoded_delta = 0;
+      uint8_t record_type = new_value_record;
+      if (!bits.get(1, flag))
+        return block;
+      if (flag == 0) {
+        if (!bits.getRice(k_delta, encoded_delta))
+          return block;
+      } else {
+        if (!bits.get(1, flag))
+          return block;
+        record_type = flag ? new_count_record : clear_history_record;
+      }
+      uint32_t elapsed = 0;
+      if (!bits.getRice(k_time, elapsed))
+        return block;
+      if (onRecordStart)
+        onRecordStart(record_start);
+      replayRecord(cp, record_type, unzigzag(encoded_delta), elapsed,
+                   onChange, onClearHistory, onNewCount);
+    }
+    block = addr + len + crc_size;
   }
 }
 
-void PersistentState::rememberNewValue(int value) {
+PersistentState::LogDamage PersistentState::decodeLog(
+    std::function<void(const LogRecord &)> onRecord) {
+  LogDamage damage;
   if (!mem->isValid())
+    return damage;
+  flush();
+  setupLayout();
+  const int pages = pageCount();
+  MemoryWindow window(mem);
+  int first_page = 0;
+  int head = findHeadPage(window, first_page);
+  if (head < 0)
+    return damage;
+  uint32_t seq = readPageSeq(head, window);
+  const int log_pages = logPages(window, head, seq);
+  const int oldest_page = (head - log_pages + 1 + pages) % pages;
+  Checkpoint cp;
+  readPageHeader(oldest_page, window, seq, cp);
+
+  // records repeated by the log after the archive are decoded once
+  uint32_t next = 0;
+  bool archived = false;
+  int record_start = 0;
+  auto emit = [&](LogRecord::Opcode opcode, int delta) {
+    if (cp.events < next)
+      return;
+    onRecord({record_start, opcode, cp.value, delta, cp.sessions, cp.time,
+              cp.events, archived});
+    next = cp.events + 1;
+  };
+  auto onChange = [&](int, int delta) { emit(LogRecord::new_value, delta); };
+  auto onClearHistory = [&]() { emit(LogRecord::clear_history, 0); };
+  auto onNewCount = [&]() { emit(LogRecord::new_count, 0); };
+  auto onRecordStart = [&](int addr) { record_start = addr; };
+  // the archive continues to the log start
+  openArchive(window);
+  if (archive_events >= cp.events && readArchiveStart(window, cp)) {
+    archived = true;
+    for (int i = archiveChain(window) - 1; i >= 0; --i) {
+      const int page = (archive_head - i + archive_pages) % archive_pages;
+      const int end =
+          replayArchivePage(page, window, cp, onChange, onClearHistory,
+                            onNewCount, onRecordStart);
+      if (end < archivePageAddr(page) + page_size &&
+          window[end] != end_of_page)
+        damage.broken_pages++;
+    }
+    archived = false;
+  }
+  // records stop at the end mark, anything else is a torn record in the
+  // head page, as openLog() drops it, and a broken page elsewhere
+  for (int i = 0; i < log_pages; ++i) {
+    const int page = (oldest_page + i) % pages;
+    const int base = page * page_size;
+    int offset = readPageHeader(page, window, seq, cp);
+    if (offset == 0) {
+      damage.broken_pages++;
+      continue;
+    }
+    const int end = base + replayPage(page, seq, offset, window, cp, onChange,
+                                      onClearHistory, onNewCount,
+                                      onRecordStart);
+    if (end == base + page_size || window[end] == end_of_page)
+      continue;
+    if (page == head)
+      damage.torn_tails++;
+    else
+      damage.broken_pages++;
+  }
+  return damage;
+}
+
+void PersistentState::writeBatch(int start, uint8_t *buffer, int len) {
+  if (len == 0)
     return;
-  int mem_size = mem->size();
-  assert(sequence_end >= 0 && sequence_end < mem_size);
-  putEndMark(WRAP(sequence_end + 3));
-  mem->write(sequence_end, 1);
-  mem->write(WRAP(sequence_end + 1), value & 0xff);
-  mem->write(WRAP(sequence_end + 2), (value >> 8) & 0xff);
-  sequence_end = WRAP(sequence_end + 3);
+  const int page_end = (start / page_size + 1) * page_size;
+  if (start + len < page_end)
+    buffer[len++] = end_of_page;
+  // the first byte replaces end mark (or invalidates old page header)
+  // and is written last, single byte write is atomic, so log is never
+  // extended by partially written bytes
+  mem->writeBlock(start + 1, buffer + 1, len - 1);
+  mem->writeBlock(start, buffer, 1);
 }
 
-void PersistentState::rememberClearHistory() {
+void PersistentState::flush() {
+  if (pending_count == 0 || !mem->isValid())
+    return;
+  if (head_seq == 0)
+    openLog();
+  // records are collected in one buffer and written at once,
+  // batch is split only when a new page is started
+  uint8_t buffer[max_page_header_size + max_pending_events * max_record_size +
+                 1];
+  int batch_start = sequence_end;
+  int pos = 0;
+  for (int i = 0; i < pending_count; ++i) {
+    const PendingEvent &event = pending[i];
+    uint8_t record[max_record_size];
+    // clock could go back, e.g. when it wraps
+    const uint32_t time = std::max(event.time, state.time);
+    int len = putEventRecord(record, event.record_type, event.value, time,
+                             state);
+    if (sequence_end + len + crc_size > (head_page + 1) * page_size) {
+      // no room left, continue in the next page overwriting the oldest one
+      writeBatch(batch_start, buffer, pos);
+      head_page = (head_page + 1) % pageCount();
+      head_seq++;
+      archiveLogPage(head_page);
+      batch_start = head_page * page_size;
+      mem->erase(batch_start, page_size);
+      pos = putPageHeader(buffer, head_seq, state);
+      sequence_end = batch_start + pos;
+    }
+    std::copy(record, record + len, buffer + pos);
+    buffer[pos + len] = crc8(seqCrc(head_seq), record, len);
+    pos += len + crc_size;
+    sequence_end += len + crc_size;
+    applyEvent(state, event.record_type, event.value, time);
+  }
+  writeBatch(batch_start, buffer, pos);
+  pending_count = 0;
+}
+
+void PersistentState::queueEvent(uint8_t record_type, int value) {
   if (!mem->isValid())
     return;
-  int mem_size = mem->size();
-  assert(sequence_end >= 0 && sequence_end < mem_size);
-  putEndMark(WRAP(sequence_end + 1));
-  mem->write(sequence_end, 2);
-  sequence_end = WRAP(sequence_end + 1);
+  if (pending_count == max_pending_events)
+    flush();
+  // time is continued from the log, so it has to be opened
+  if (head_seq == 0)
+    openLog();
+  uint32_t time = state.time;
+  if (clock)
+    time = time_base + clock() / time_unit_ms;
+  pending[pending_count++] = {record_type, value, time};
+}
+
+void PersistentState::rememberNewValue(int value) {
+  queueEvent(new_value_record, value);
+}
+
+void PersistentState::rememberClearHistory() {
+  queueEvent(clear_history_record, 0);
 }
 
 void PersistentState::rememberStartNewCount() {
+  queueEvent(new_count_record, 0);
+}
+
+// Snapshot bank:
+// uint32 version, grows by one with every write, zero marks empty bank
+// uint32 fields of the checkpoint: events, value, history_items,
+//        session_items, history_records
+// uint8 number of history window entries, followed by the entries:
+//   uint8 record type, int32 value, int32 counter value before the record
+// crc8 of all previous bytes
+// Bank with odd version is the first one.
+
+namespace {
+constexpr int snapshot_header_size = 6 * 4 + 1;
+constexpr int snapshot_entry_size = 1 + 2 * 4;
+constexpr int max_snapshot_size =
+    snapshot_header_size +
+    SnapshotState::history_window * snapshot_entry_size + crc_size;
+
+uint32_t getU32(const uint8_t *buffer) {
+  uint32_t value = 0;
+  for (int i = 0; i < 4; ++i)
+    value |= static_cast<uint32_t>(buffer[i]) << (8 * i);
+  return value;
+}
+} // namespace
+
+void SnapshotState::setup(PersistentMemoryWrapper *m) {
+  mem = m;
+  opened = false;
+  pending_count = 0;
+  const int erase_size = m->eraseSize();
+  bank_size = (max_snapshot_size + erase_size - 1) / erase_size * erase_size;
+}
+
+uint32_t SnapshotState::readBank(int bank, uint8_t *buffer) const {
+  mem->readBlock(bank * bank_size, buffer, max_snapshot_size);
+  const uint32_t bank_version = getU32(buffer);
+  const int count = buffer[snapshot_header_size - 1];
+  const int len = snapshot_header_size + count * snapshot_entry_size;
+  if (count > history_window || buffer[len] != crc8(crc_init, buffer, len))
+    return 0;
+  return bank_version;
+}
+
+void SnapshotState::loadBank(const uint8_t *buffer) {
+  version = getU32(buffer);
+  const uint8_t *field = buffer + 4;
+  state.events = getU32(field);
+  state.value = static_cast<int>(getU32(field + 4));
+  state.history_items = getU32(field + 8);
+  state.session_items = getU32(field + 12);
+  state.history_records = getU32(field + 16);
+  window_count = buffer[snapshot_header_size - 1];
+  for (int i = 0; i < window_count; ++i) {
+    const uint8_t *entry =
+        buffer + snapshot_header_size + i * snapshot_entry_size;
+    window[i] = {entry[0], static_cast<int>(getU32(entry + 1)),
+                 static_cast<int>(getU32(entry + 5))};
+  }
+}
+
+void SnapshotState::openSnapshot() {
+  assert(2 * bank_size <= mem->size());
+  opened = true;
+  version = 0;
+  state = Checkpoint();
+  window_count = 0;
+  // the newest valid bank wins, torn write leaves the other one intact
+  uint8_t banks[2][max_snapshot_size];
+  uint32_t versions[2];
+  for (int bank = 0; bank < 2; ++bank)
+    versions[bank] = readBank(bank, banks[bank]);
+  if (versions[0] == 0 && versions[1] == 0)
+    return;
+  int newest = versions[0] == 0 ? 1 : 0;
+  if (versions[0] != 0 && versions[1] != 0 &&
+      static_cast<int32_t>(versions[1] - versions[0]) > 0)
+    newest = 1;
+  loadBank(banks[newest]);
+}
+
+void SnapshotState::restoreFromMem(
+    int min_events, std::function<void(const Checkpoint &)> onCheckpoint,
+    std::function<void(int, int)> onChange,
+    std::function<void()> onClearHistory, std::function<void()> onNewCount) {
   if (!mem->isValid())
     return;
-  int mem_size = mem->size();
-  assert(sequence_end >= 0 && sequence_end < mem_size);
-  putEndMark(WRAP(sequence_end + 1));
-  mem->write(sequence_end, 3);
-  sequence_end = WRAP(sequence_end + 1);
+  flush();
+  openSnapshot();
+  // window has no history clear, values after the last new count
+  // are the current count
+  int replayed = 0;
+  while (replayed < window_count && replayed < min_events &&
+         window[window_count - 1 - replayed].record_type == new_value_record)
+    replayed++;
+  Checkpoint cp = state;
+  cp.events -= replayed;
+  cp.history_items -= replayed;
+  cp.session_items -= replayed;
+  cp.history_records -= replayed;
+  if (replayed > 0)
+    cp.value = window[window_count - replayed].previous_value;
+  if (onCheckpoint)
+    onCheckpoint(cp);
+  for (int i = window_count - replayed; i < window_count; ++i)
+    if (onChange)
+      onChange(window[i].value, window[i].value - window[i].previous_value);
+}
+
+void SnapshotState::queueEvent(uint8_t record_type, int value) {
+  if (!mem->isValid())
+    return;
+  if (!opened)
+    openSnapshot();
+  if (pending_count == max_pending_events)
+    flush();
+  Entry entry = {record_type, record_type == new_value_record ? value : 0,
+                 state.value};
+  // snapshots do not keep time
+  applyEvent(state, record_type, value, 0);
+  if (record_type == clear_history_record) {
+    window_count = 0;
+  } else {
+    if (window_count == history_window)
+      std::copy(window + 1, window + history_window, window);
+    else
+      window_count++;
+    window[window_count - 1] = entry;
+  }
+  pending_count++;
+}
+
+void SnapshotState::flush() {
+  if (pending_count == 0 || !mem->isValid())
+    return;
+  version++;
+  uint8_t buffer[max_snapshot_size];
+  uint8_t *end = putU32(buffer, version);
+  end = putU32(end, state.events);
+  end = putU32(end, static_cast<uint32_t>(state.value));
+  end = putU32(end, state.history_items);
+  end = putU32(end, state.session_items);
+  end = putU32(end, state.history_records);
+  *end++ = window_count;
+  for (int i = 0; i < window_count; ++i) {
+    *end++ = window[i].record_type;
+    end = putU32(end, static_cast<uint32_t>(window[i].value));
+    end = putU32(end, static_cast<uint32_t>(window[i].previous_value));
+  }
+  *end = crc8(crc_init, buffer, end - buffer);
+  end += crc_size;
+  // banks alternate, the older one is overwritten
+  const int addr = (version % 2 == 1 ? 0 : 1) * bank_size;
+  mem->erase(addr, bank_size);
+  mem->writeBlock(addr, buffer, end - buffer);
+  pending_count = 0;
+}
+
+void SnapshotState::rememberNewValue(int value) {
+  queueEvent(new_value_record, value);
+}
+
+void SnapshotState::rememberClearHistory() {
+  queueEvent(clear_history_record, 0);
+}
+
+void SnapshotState::rememberStartNewCount() {
+  queueEvent(new_count_record, 0);
+}
+
+int SnapshotState::historySize() {
+  if (!mem->isValid())
+    return 0;
+  if (!opened)
+    openSnapshot();
+  return window_count;
+}
+
+void SnapshotState::readHistory(
+    int first, int count,
+    std::function<void(int, const HistoryRecord &)> onRecord) {
+  const int size = historySize();
+  first = std::max(first, 0);
+  count = std::min(count, size - first);
+  if (count <= 0)
+    return;
+  // item numbers are counted back from the current state
+  int item_no = state.history_items;
+  for (int i = first + 1; i < size; ++i)
+    if (window[i].record_type == new_value_record)
+      item_no--;
+  for (int i = first; i < first + count; ++i) {
+    const Entry &entry = window[i];
+    if (i > first && entry.record_type == new_value_record)
+      item_no++;
+    if (entry.record_type == new_count_record)
+      onRecord(i, {true, 0, 0, item_no, 0, 0});
+    else
+      onRecord(i, {false, entry.value, entry.value - entry.previous_value,
+                   item_no, 0, 0});
+  }
+}
+
+// Log sync protocol, numbers are varints.
+// Request, host to device:
+// 'R', number of the first record the host does not have, crc8
+// Answer, device to host:
+// 'C', number of the first record in the chunk, number of records logged,
+// number of records in the chunk, zigzag counter value and log time before
+// the first record, size of the data, data, crc8 of all previous bytes
+// Data is records as in the log without crc. Chunk starts later than asked
+// if older records are not kept anymore, it is empty if the host has all
+// records. Broken request is ignored, host asks again after a timeout.
+
+namespace {
+constexpr uint8_t sync_request_mark = 'R';
+constexpr uint8_t sync_chunk_mark = 'C';
+
+// returns false if varint does not end before len
+bool getVarint(const uint8_t *buffer, int &pos, int len, uint32_t &value) {
+  value = 0;
+  for (int i = 0; i < max_varint_size && pos < len; ++i) {
+    uint8_t byte = buffer[pos++];
+    value |= static_cast<uint32_t>(byte & 0x7f) << (7 * i);
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+} // namespace
+
+void LogSync::setup(PersistentState *s, std::function<int()> read,
+                    std::function<void(const uint8_t *, int)> write,
+                    std::function<void(uint8_t)> onOtherByte) {
+  state = s;
+  this->read = read;
+  this->write = write;
+  this->onOtherByte = onOtherByte;
+  request_len = 0;
+  output_len = 0;
+  output_pos = 0;
+}
+
+void LogSync::poll() {
+  // requests wait in the line until the answer is sent
+  for (int byte; !sending() && (byte = read()) >= 0;) {
+    if (request_len == 0 && byte != sync_request_mark) {
+      if (onOtherByte)
+        onOtherByte(byte);
+      continue;
+    }
+    request[request_len++] = byte;
+    int pos = 1;
+    uint32_t first = 0;
+    if (getVarint(request, pos, request_len, first)) {
+      if (pos == request_len)
+        continue;
+      // crc follows the varint
+      if (request[pos] == crc8(crc_init, request, pos))
+        answer(first);
+      request_len = 0;
+    } else if (request_len == max_request_size - crc_size) {
+      // too long varint
+      request_len = 0;
+    }
+  }
+  if (sending()) {
+    int len = output_len - output_pos;
+    if (len > max_write_size)
+      len = max_write_size;
+    write(output + output_pos, len);
+    output_pos += len;
+  }
+}
+
+void LogSync::answer(uint32_t first) {
+  // records are encoded first, the header needs the state before them
+  uint8_t data[max_chunk_size];
+  uint8_t *end = data;
+  PersistentState::Checkpoint start;
+  uint32_t time = 0;
+  const int count = state->replayLog(
+      first, max_chunk_records, start,
+      [&](PersistentState::LogRecord::Opcode opcode, int delta,
+          uint32_t record_time) {
+        if (end == data)
+          time = start.time;
+        if (opcode == PersistentState::LogRecord::new_value)
+          end += putNewValueRecord(end, delta);
+        else
+          *end++ = opcode;
+        end = putVarint(end, record_time - time);
+        time = record_time;
+      });
+  const int len = end - data;
+  end = output;
+  *end++ = sync_chunk_mark;
+  end = putVarint(end, start.events);
+  end = putVarint(end, state->eventCount());
+  end = putVarint(end, count);
+  end = putVarint(end, zigzag(start.value));
+  end = putVarint(end, start.time);
+  end = putVarint(end, len);
+  end = std::copy(data, data + len, end);
+  *end = crc8(crc_init, output, end - output);
+  end += crc_size;
+  output_len = end - output;
+  output_pos = 0;
+}
+
+int LogSync::putRequest(uint8_t *buffer, uint32_t first) {
+  uint8_t *end = buffer;
+  *end++ = sync_request_mark;
+  end = putVarint(end, first);
+  *end = crc8(crc_init, buffer, end - buffer);
+  return end + crc_size - buffer;
+}
+
+int LogSync::parseChunk(const uint8_t *data, int len, uint32_t &next,
+                        uint32_t &total,
+                        std::function<void(const Record &)> onRecord) {
+  if (len == 0)
+    return 0;
+  if (data[0] != sync_chunk_mark)
+    return -1;
+  int pos = 1;
+  uint32_t first = 0;
+  uint32_t count = 0;
+  uint32_t value = 0;
+  uint32_t time = 0;
+  uint32_t data_len = 0;
+  uint32_t logged = 0;
+  for (uint32_t *field : {&first, &logged, &count, &value, &time, &data_len})
+    if (!getVarint(data, pos, len, *field))
+      // too long varint is broken, otherwise the rest is not received yet
+      return pos < len ? -1 : 0;
+  if (data_len > max_chunk_size || count > max_chunk_records)
+    return -1;
+  const int size = pos + data_len + crc_size;
+  if (len < size)
+    return 0;
+  if (data[size - 1] != crc8(crc_init, data, size - 1))
+    return -1;
+
+  // records are delivered only after the whole chunk is decoded
+  Record records[max_chunk_records];
+  Record record = {first, PersistentState::LogRecord::new_value,
+                   unzigzag(value), 0, time};
+  const int data_end = pos + data_len;
+  for (uint32_t i = 0; i < count; ++i) {
+    uint8_t record_type = pos < data_end ? data[pos++] : end_of_page;
+    uint32_t encoded_delta = 0;
+    if (record_type & short_delta_flag)
+      encoded_delta = record_type & ~short_delta_flag;
+    else if (record_type == new_value_record &&
+             !getVarint(data, pos, data_end, encoded_delta))
+      return -1;
+    else if (record_type != new_value_record &&
+             record_type != clear_history_record &&
+             record_type != new_count_record)
+      return -1;
+    uint32_t elapsed = 0;
+    if (!getVarint(data, pos, data_end, elapsed))
+      return -1;
+    PersistentState::Checkpoint cp;
+    cp.value = record.value;
+    replayRecord(cp, record_type, unzigzag(encoded_delta), elapsed, nullptr,
+                 nullptr, nullptr);
+    record.opcode = static_cast<PersistentState::LogRecord::Opcode>(
+        record_type & short_delta_flag ? new_value_record : record_type);
+    record.value = cp.value;
+    record.delta = record.opcode == PersistentState::LogRecord::new_value
+                       ? unzigzag(encoded_delta)
+                       : 0;
+    record.time += elapsed;
+    records[i] = record;
+    record.events++;
+  }
+  if (pos != data_end)
+    return -1;
+  for (uint32_t i = 0; i < count; ++i)
+    onRecord(records[i]);
+  next = first + count;
+  total = logged;
+  return size;
 }
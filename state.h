@@ -3,27 +3,531 @@
 
 #include "hal.h"
 
+/**
+ * @brief bounded window over persistent memory
+ *
+ * Bytes are fetched in chunks of window_size on demand,
+ * so log is decoded with constant RAM whatever memory size is.
+ * Addresses wrap around the end of memory.
+ */
+class MemoryWindow {
+  static constexpr int window_size = 64;
+  const PersistentMemoryWrapper *mem;
+  const int mem_size;
+  const int wrap_mask; // mem_size - 1 if it is a power of two, otherwise -1
+  uint8_t data[window_size];
+  int start = 0;
+  int len = 0;
+
+  int wrap(int addr) const {
+    return wrap_mask >= 0 ? addr & wrap_mask : addr % mem_size;
+  }
+
+  uint8_t fetch(int addr) {
+    addr = wrap(addr);
+    int pos = wrap(addr - start + mem_size);
+    if (pos >= len) {
+      start = addr;
+      len = mem_size < window_size ? mem_size : window_size;
+      mem->readBlock(start, data, len);
+      pos = 0;
+    }
+    return data[pos];
+  }
+
+public:
+  explicit MemoryWindow(const PersistentMemoryWrapper *mem)
+      : mem(mem), mem_size(mem->size()),
+        wrap_mask((mem_size & (mem_size - 1)) == 0 ? mem_size - 1 : -1) {}
+
+  uint8_t operator[](int addr) {
+    // sequential reads hit the window, then the address is not wrapped
+    unsigned pos = addr - start;
+    if (pos < static_cast<unsigned>(len))
+      return data[pos];
+    return fetch(addr);
+  }
+};
+
 class PersistentState {
+public:
+  /**
+   * @brief snapshot of counter state at some point of the log
+   *
+   * Every page starts with a checkpoint, so restore could begin from
+   * any page instead of replaying the whole log.
+   */
+  struct Checkpoint {
+    uint32_t events = 0;   // number of records logged before this point
+    int value = 0;         // counter value
+    int history_items = 0; // values added since history was cleared
+    int session_items = 0; // values added since new count was started
+    uint32_t history_records = 0; // records since history was cleared
+    uint32_t time = 0; // log time of the last record, in time units
+    uint32_t sessions = 0; // new counts since the log was created
+  };
+
+  // record of the history, as shown to the user
+  struct HistoryRecord {
+    bool new_count; // start of new count, otherwise new value
+    int value;
+    int delta;
+    int item_no; // number of the value since history was cleared
+    uint32_t time;     // log time of the record, in time units
+    uint32_t interval; // time since the previous record, in time units
+  };
+
+  static constexpr int default_page_size = 128;
+
+  // records keep time passed since the previous one in these units,
+  // so typical pauses between button presses take a single byte
+  static constexpr int time_unit_ms = 100;
+
+  // rewritable memories of at least min_pages_for_archive pages keep
+  // half of the pages as the archive, records of evicted log pages are
+  // compressed there
+  static constexpr int min_pages_for_archive = 8;
+
+  /**
+   * @brief start of a counting session
+   *
+   * Checkpoints count sessions, so a session is found with binary search
+   * over them and a page of replay, without decoding the log.
+   */
+  struct Session {
+    uint32_t number = 0;    // number of new counts since the log was created
+    uint32_t events = 0;    // number of records before the session start
+    int previous_value = 0; // counter value before the new count
+  };
+
+  // record of the log, as it is stored in memory
+  struct LogRecord {
+    enum Opcode : uint8_t { new_value = 1, clear_history = 2, new_count = 3 };
+
+    int offset;     // address of the record in memory
+    Opcode opcode;
+    int value;      // counter value after the record
+    int delta;      // change of the value, 0 for other records
+    uint32_t session; // number of the session the record belongs to
+    uint32_t time;    // log time of the record, in time units
+    uint32_t events;  // number of records logged before this one
+    bool archived;    // record is read from the archive
+  };
+
+  // damage found by decodeLog()
+  struct LogDamage {
+    int torn_tails = 0;   // head pages ending with a torn record
+    int broken_pages = 0; // other pages with a bad crc or garbage
+  };
+
+  // events are kept in RAM until flush(), so at most this many
+  // remembered events are lost at power cut
+  static constexpr int max_pending_events = 8;
+
+private:
+  // event waiting in RAM to be written to the log
+  struct PendingEvent {
+    uint8_t record_type;
+    int value;
+    uint32_t time;
+  };
+
   PersistentMemoryWrapper *mem = nullptr;
+  int page_size = default_page_size;
+  int head_page = 0;
+  uint32_t head_seq = 0;
   int sequence_end = 0;
+  Checkpoint state;
+  int archive_pages = 0;
+  int archive_head = 0;        // archive page being filled
+  uint32_t archive_seq = 0;    // sequence number of the archive head
+  int archive_end = 0;         // address after the last archive block
+  uint32_t archive_events = 0; // records logged before the archive end
+  PendingEvent pending[max_pending_events];
+  int pending_count = 0;
+  std::function<unsigned long()> clock;
+  uint32_t time_base = 0; // log time when the clock was zero
+
+  int pageCount() const {
+    return mem->size() / page_size - archive_pages;
+  }
+
+  int archivePageAddr(int page) const {
+    return (pageCount() + page) * page_size;
+  }
+
+  uint32_t readArchiveSeq(int page, MemoryWindow &window) const;
+
+  int archiveChain(MemoryWindow &window) const;
+
+  bool readArchiveStart(MemoryWindow &window, Checkpoint &cp) const;
+
+  void resetArchive();
+
+  void openArchive(MemoryWindow &window);
 
-  void putEndMark(int offset);
+  bool archiveContinues(const Checkpoint &start) const;
+
+  int archiveRoom() const;
+
+  void startArchivePage();
+
+  void writeArchiveBlock(const Checkpoint &start, uint32_t records,
+                         const uint8_t *payload, int len);
+
+  void archiveLogPage(int page);
+
+  // returns address of the first block which is not replayed
+  int replayArchivePage(int page, MemoryWindow &window, Checkpoint &cp,
+                         const std::function<void(int, int)> &onChange,
+                         const std::function<void()> &onClearHistory,
+                         const std::function<void()> &onNewCount,
+                         const std::function<void(int)> &onRecordStart =
+                             nullptr);
+
+  // first record still kept in the log or the archive
+  uint32_t oldestEvent(MemoryWindow &window) const;
+
+  // replays kept records from the newest checkpoint for which before holds,
+  // until done holds after a page, the oldest checkpoint is used if there
+  // is no such one
+  void replayFrom(const std::function<bool(const Checkpoint &)> &before,
+                  const std::function<bool()> &done, MemoryWindow &window,
+                  Checkpoint &cp,
+                  const std::function<void(int, int)> &onChange,
+                  const std::function<void()> &onClearHistory,
+                  const std::function<void()> &onNewCount,
+                  const std::function<void(int)> &onRecordStart);
+
+  // replays kept records from the newest checkpoint not after record from,
+  // until record to is replayed
+  void replayRange(uint32_t from, uint32_t to, MemoryWindow &window,
+                   Checkpoint &cp,
+                   const std::function<void(int, int)> &onChange,
+                   const std::function<void()> &onClearHistory,
+                   const std::function<void()> &onNewCount,
+                   const std::function<void(int)> &onRecordStart);
+
+  int readPageHeader(int page, MemoryWindow &window, uint32_t &seq,
+                     Checkpoint &cp) const;
+
+  uint32_t readPageSeq(int page, MemoryWindow &window) const;
+
+  int findHeadPage(MemoryWindow &window, int &first) const;
+
+  int logPages(MemoryWindow &window, int head, uint32_t seq) const;
+
+  void setupLayout();
+
+  void format();
+
+  int openLog();
+
+  int replayPage(int page, uint32_t seq, int offset, MemoryWindow &window,
+                 Checkpoint &cp, const std::function<void(int, int)> &onChange,
+                 const std::function<void()> &onClearHistory,
+                 const std::function<void()> &onNewCount,
+                 const std::function<void(int)> &onRecordStart = nullptr);
+
+  void restoreFrom(bool visible_only, int min_events,
+                   const std::function<void(const Checkpoint &)> &onCheckpoint,
+                   const std::function<void(int, int)> &onChange,
+                   const std::function<void()> &onClearHistory,
+                   const std::function<void()> &onNewCount);
+
+  void writeBatch(int start, uint8_t *buffer, int len);
+
+  void queueEvent(uint8_t record_type, int value);
 
 public:
   PersistentState() = default;
-  PersistentState(PersistentMemoryWrapper *m) : mem(m) {}
+  PersistentState(PersistentMemoryWrapper *m,
+                  int page_size = default_page_size)
+      : mem(m), page_size(page_size) {}
 
-  void setup(PersistentMemoryWrapper *m) { mem = m; }
+  // pages are never smaller than erase block of the memory
+  void setup(PersistentMemoryWrapper *m) {
+    mem = m;
+    head_seq = 0;
+    pending_count = 0;
+    state = Checkpoint();
+    page_size = m->eraseSize() > default_page_size ? m->eraseSize()
+                                                   : default_page_size;
+  }
+
+  /**
+   * @brief sets source of milliseconds since boot, e.g. HAL::uptimeMillis
+   *
+   * Remembered events are stamped with log time, which continues from
+   * the last logged record. Without the clock log time does not change.
+   */
+  void setClock(std::function<unsigned long()> uptime_ms) {
+    clock = uptime_ms;
+  }
 
   void restoreFromMem(std::function<void(int, int)> onChange,
                       std::function<void()> onClearHistory,
                       std::function<void()> onNewCount);
 
+  /**
+   * @brief restores only the visible tail of the log
+   *
+   * Replays the last min_events values, but never goes back past the last
+   * history clear or new count, state before them is passed to
+   * onCheckpoint. Start is found with binary search over page checkpoints,
+   * so replay cost does not depend on memory size.
+   */
+  void restoreFromMem(int min_events,
+                      std::function<void(const Checkpoint &)> onCheckpoint,
+                      std::function<void(int, int)> onChange,
+                      std::function<void()> onClearHistory,
+                      std::function<void()> onNewCount);
+
   void rememberNewValue(int value);
 
   void rememberClearHistory();
 
   void rememberStartNewCount();
+
+  /**
+   * @brief writes remembered events to persistent memory
+   *
+   * Queued events are written as one group, usually with a single memory
+   * transaction, so it should be called when device is idle. Queue is
+   * flushed automatically when it is full.
+   */
+  void flush();
+
+  int pendingEvents() const { return pending_count; }
+
+  /**
+   * @brief number of records since history was cleared, which are
+   * still kept in memory
+   */
+  int historySize();
+
+  /**
+   * @brief decodes records [first, first + count) of the history
+   *
+   * Records are numbered from the oldest one, see historySize().
+   * Only the pages holding requested records are decoded, so history
+   * could be paged as deep as memory allows.
+   */
+  void readHistory(int first, int count,
+                   std::function<void(int, const HistoryRecord &)> onRecord);
+
+  // number of the last started session, 0 if there is none
+  uint32_t lastSession();
+
+  /**
+   * @brief looks the session up by its number
+   *
+   * Returns false if its start is not kept in the log or the archive.
+   */
+  bool findSession(uint32_t number, Session &session);
+
+  // history row of the session start, -1 if it is not in the history
+  int sessionHistoryRow(const Session &session);
+
+  /**
+   * @brief state after the first events records of the log
+   *
+   * The newest page or archive checkpoint before them is found with
+   * binary search, so only a page or two are replayed. Returns false if
+   * the records are not kept anymore.
+   */
+  bool stateAt(uint32_t events, Checkpoint &cp);
+
+  // state right after the new count of the session, which must be kept
+  bool sessionStartState(uint32_t number, Checkpoint &cp);
+
+  // number of records logged so far, remembered events included
+  uint32_t eventCount();
+
+  /**
+   * @brief replays kept records [first, first + count) of the log
+   *
+   * Replay starts from the page holding the first record, start is set to
+   * the state before it. If the first record is not kept anymore, replay
+   * starts from the oldest kept one. onRecord gets the record type, delta
+   * of the value and log time of the record. Returns the number of
+   * replayed records.
+   */
+  int replayLog(
+      uint32_t first, int count, Checkpoint &start,
+      std::function<void(LogRecord::Opcode, int, uint32_t)> onRecord);
+
+  /**
+   * @brief decodes every record of the archive and the log, oldest first
+   *
+   * Archived records come first, records repeated by the log are decoded
+   * once. Records of a page stop at the end mark, a torn or broken record
+   * stops them earlier and is reported as damage. Log is only read, broken
+   * or torn tail is not repaired, so memory dumps could be inspected as
+   * is. Sessions are numbered from the log creation, see
+   * Checkpoint::sessions.
+   */
+  LogDamage decodeLog(std::function<void(const LogRecord &)> onRecord);
+};
+
+/**
+ * @brief counter state kept as a snapshot instead of the event log
+ *
+ * Memory holds two banks with the whole state and the recent history,
+ * every flush overwrites the older bank. Restore reads both banks and takes
+ * the newest valid one, so boot takes a bounded read without any replay.
+ * Only the last history_window records of the history are kept.
+ * Could be used in place of PersistentState, see SNAPSHOT_STATE.
+ */
+class SnapshotState {
+public:
+  using Checkpoint = PersistentState::Checkpoint;
+  using HistoryRecord = PersistentState::HistoryRecord;
+
+  static constexpr int history_window = 32;
+  static constexpr int max_pending_events = PersistentState::max_pending_events;
+
+private:
+  // record of the history window
+  struct Entry {
+    uint8_t record_type;
+    int value;
+    int previous_value; // counter value before the record
+  };
+
+  PersistentMemoryWrapper *mem = nullptr;
+  int bank_size = 0; // distance between banks, aligned to erase blocks
+  bool opened = false;
+  uint32_t version = 0; // version of the newest bank, 0 if there is none
+  Checkpoint state;
+  Entry window[history_window];
+  int window_count = 0;
+  int pending_count = 0;
+
+  // returns version of the bank, 0 if it is not valid
+  uint32_t readBank(int bank, uint8_t *buffer) const;
+
+  void loadBank(const uint8_t *buffer);
+
+  void openSnapshot();
+
+  void queueEvent(uint8_t record_type, int value);
+
+public:
+  SnapshotState() = default;
+  explicit SnapshotState(PersistentMemoryWrapper *m) { setup(m); }
+
+  void setup(PersistentMemoryWrapper *m);
+
+  /**
+   * @brief restores the state from the newest bank
+   *
+   * Values of the current count are replayed, at most min_events of them,
+   * after onCheckpoint is called with the state before them. History clear
+   * and new count are never replayed, checkpoint already includes them.
+   */
+  void restoreFromMem(int min_events,
+                      std::function<void(const Checkpoint &)> onCheckpoint,
+                      std::function<void(int, int)> onChange,
+                      std::function<void()> onClearHistory,
+                      std::function<void()> onNewCount);
+
+  void rememberNewValue(int value);
+
+  void rememberClearHistory();
+
+  void rememberStartNewCount();
+
+  // writes the snapshot to the older bank, if anything was remembered
+  void flush();
+
+  int pendingEvents() const { return pending_count; }
+
+  // number of records since history was cleared, at most history_window
+  int historySize();
+
+  void readHistory(int first, int count,
+                   std::function<void(int, const HistoryRecord &)> onRecord);
+};
+
+/**
+ * @brief serves the log to a host over a serial line
+ *
+ * Host asks for records starting from the first one it does not have,
+ * device answers with a chunk of at most max_chunk_records of them,
+ * protected by a checksum. Host asks for the next chunk right after the
+ * last received record, so a lost or broken chunk is asked again and
+ * the transfer continues from where it stopped. Host helpers are static,
+ * they do not need the log.
+ */
+class LogSync {
+public:
+  static constexpr int max_chunk_records = 32;
+  static constexpr int max_request_size = 1 + 5 + 1;
+  // six varint header fields, records without crc and crc
+  static constexpr int max_chunk_size =
+      1 + 6 * 5 + max_chunk_records * (1 + 2 * 5) + 1;
+  // answer is written in pieces of this size, one per poll(), 16 bytes
+  // take 17 ms at 9600 baud, so the loop is never blocked for long
+  static constexpr int max_write_size = 16;
+
+  // record of the log, as it is received by the host
+  struct Record {
+    uint32_t events; // number of records logged before this one
+    PersistentState::LogRecord::Opcode opcode;
+    int value; // counter value after the record
+    int delta; // change of the value, 0 for other records
+    uint32_t time; // log time of the record, in time units
+  };
+
+private:
+  PersistentState *state = nullptr;
+  std::function<int()> read;
+  std::function<void(const uint8_t *, int)> write;
+  std::function<void(uint8_t)> onOtherByte;
+  uint8_t request[max_request_size];
+  int request_len = 0;
+  uint8_t output[max_chunk_size]; // answer being sent
+  int output_len = 0;
+  int output_pos = 0;
+
+  void answer(uint32_t first);
+
+public:
+  /**
+   * @brief sets the log and the line
+   *
+   * read returns the next received byte or -1 if there is none. Bytes
+   * received outside of requests are passed to onOtherByte, e.g. debug
+   * commands.
+   */
+  void setup(PersistentState *s, std::function<int()> read,
+             std::function<void(const uint8_t *, int)> write,
+             std::function<void(uint8_t)> onOtherByte = nullptr);
+
+  // handles received bytes and sends the next piece of the answer
+  void poll();
+
+  // returns true until the whole answer is written
+  bool sending() const { return output_pos < output_len; }
+
+  // returns true while a request is being received or answered
+  bool busy() const { return request_len > 0 || sending(); }
+
+  // returns size of the request for records starting from first
+  static int putRequest(uint8_t *buffer, uint32_t first);
+
+  /**
+   * @brief decodes a chunk received by the host
+   *
+   * Returns the size of the chunk, 0 if it is not complete yet, or -1
+   * if it is broken and should be asked again. Records are passed to
+   * onRecord only when the whole chunk is valid. next is set to the record
+   * after the chunk, total to the number of records logged on the device.
+   */
+  static int parseChunk(const uint8_t *data, int len, uint32_t &next,
+                        uint32_t &total,
+                        std::function<void(const Record &)> onRecord);
 };
 
-#endif // STATE_H
\ No newline at end of file
+#endif // STATE_H
@@ -0,0 +1,77 @@
+// Host benchmark of log restore.
+// usage: state_benchmark [repeats] [image_dir]
+// Every memory size is filled with a log, which wraps around the ring,
+// then full and bounded restores are timed. With image_dir memories are
+// kept there as files, state_<size>.bin, existing images are timed as
+// they are, so simulated devices or real dumps could be benchmarked too.
+
+#include "state.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+
+namespace {
+template <typename F> double averageUs(int repeats, F f) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < repeats; ++i)
+    f();
+  std::chrono::duration<double, std::micro> time =
+      std::chrono::steady_clock::now() - start;
+  return time.count() / repeats;
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  const int repeats = argc > 1 ? atoi(argv[1]) : 20;
+  const char *image_dir = argc > 2 ? argv[2] : nullptr;
+  if (repeats <= 0 || argc > 3) {
+    fprintf(stderr, "usage: %s [repeats] [image_dir]\n", argv[0]);
+    return 2;
+  }
+  printf("%10s %10s %14s %12s %14s\n", "size", "events", "full_us",
+         "ns_per_event", "bounded_us");
+  for (int size : {1 << 10, 3 << 10, 64 << 10, 1 << 20}) {
+    std::unique_ptr<PersistentMemory> raw_mem;
+    bool filled = false;
+    if (image_dir) {
+      std::string path =
+          std::string(image_dir) + "/state_" + std::to_string(size) + ".bin";
+      struct stat st;
+      filled = stat(path.c_str(), &st) == 0 && st.st_size == size;
+      raw_mem.reset(new PersistentMemory(path.c_str(), size));
+      if (!raw_mem->begin()) {
+        fprintf(stderr, "%s: can not open %s\n", argv[0], path.c_str());
+        return 1;
+      }
+    } else
+      raw_mem.reset(new PersistentMemory(true, size));
+    PersistentMemoryWrapper mem(raw_mem.get(), size);
+    mem.setup();
+    PersistentState s(&mem);
+    s.restoreFromMem([](int, int) {}, []() {}, []() {});
+    for (int i = 1; !filled && i <= size; ++i) {
+      s.rememberNewValue(i % 7 ? i : -i);
+      if (i % 500 == 0)
+        s.rememberStartNewCount();
+    }
+    s.flush();
+
+    int events = 0;
+    double full_us = averageUs(repeats, [&]() {
+      events = 0;
+      PersistentState restored(&mem);
+      restored.restoreFromMem([&](int, int) { events++; },
+                              [&]() { events++; }, [&]() { events++; });
+    });
+    double bounded_us = averageUs(repeats, [&]() {
+      PersistentState restored(&mem);
+      restored.restoreFromMem(8, nullptr, [](int, int) {}, nullptr, nullptr);
+    });
+    printf("%10d %10d %14.1f %12.1f %14.1f\n", size, events, full_us,
+           full_us * 1000 / events, bounded_us);
+  }
+  return 0;
+}
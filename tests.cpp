@@ -3,8 +3,13 @@
 #include "counter_gui.h"
 #include "screens.h"
 #include "state.h"
+#include <chrono>
+#include <fcntl.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <unistd.h>
 
 using ::testing::_;
 using ::testing::An;
@@ -105,6 +110,7 @@ void expectMenuScreen(Display &d, int selected_item) {
   EXPECT_CALL(d, setCursor(0, CHAR_H));
   EXPECT_CALL(d, setCursor(0, CHAR_H * 2));
   EXPECT_CALL(d, setCursor(0, CHAR_H * 3));
+  EXPECT_CALL(d, setCursor(0, CHAR_H * 4));
   EXPECT_CALL(d, setCursor(0, 53));
   EXPECT_CALL(d, setCursor(61, 53));
   EXPECT_CALL(d, setCursor(92, 53));
@@ -119,11 +125,16 @@ void expectMenuScreen(Display &d, int selected_item) {
   else
     EXPECT_CALL(d, print(Matcher<const char *>(StrEq(" show full history"))));
   if (selected_item == 2)
+    EXPECT_CALL(d,
+                print(Matcher<const char *>(StrEq("\x1ashow current count"))));
+  else
+    EXPECT_CALL(d, print(Matcher<const char *>(StrEq(" show current count"))));
+  if (selected_item == 3)
     EXPECT_CALL(d,
                 print(Matcher<const char *>(StrEq("\x1astart new counting"))));
   else
     EXPECT_CALL(d, print(Matcher<const char *>(StrEq(" start new counting"))));
-  if (selected_item == 3)
+  if (selected_item == 4)
     EXPECT_CALL(d, print(Matcher<const char *>(StrEq("\x1a"
                                                      "drop full history"))));
   else
@@ -420,6 +431,8 @@ TEST(gui_test, full_history) {
   Display d;
   PersistentMemory pm(true, 1024);
   PersistentMemoryWrapper mem(&pm, 1024);
+  // full history is kept in persistent memory only
+  mem.setup();
   HAL h(&d, &mem);
   expectSetup(h);
   counter_gui::setup(&h);
@@ -478,8 +491,10 @@ TEST(gui_test, full_history) {
 
   // scroll by continuous press
   pressAndReleaseButtonsIgnoreOutput(h, false, true, false, 100, 12, timestamp);
+  // values entered after a pause of a second show it
   expectHistoryScreen(d, {"5. 15=10+5", "6. 21=15+6", "7. 28=21+7",
-                          "8. 36=28+8", "9. 45=36+9", "10. 55=45+10"});
+                          "8. 36=28+8 1s", "9. 45=36+9 1s",
+                          "10. 55=45+10 1s"});
 
   timestamp += 1;
   expectUpdateButtons(h, timestamp, false, false, false);
@@ -494,14 +509,15 @@ TEST(gui_test, full_history) {
 
 TEST(gui_test, restoring_history) {
   Display d;
-  PersistentMemory pm(true, 32);
-  PersistentMemoryWrapper mem(&pm, 32);
+  PersistentMemory pm(true, 1024);
+  PersistentMemoryWrapper mem(&pm, 1024);
   PersistentState s(&mem);
   mem.setup();
   s.rememberNewValue(1);
   s.rememberClearHistory();
   s.rememberStartNewCount();
   s.rememberNewValue(2);
+  s.flush();
   HAL h(&d, &mem);
   expectSetup(h);
   counter_gui::setup(&h);
@@ -518,10 +534,163 @@ TEST(gui_test, restoring_history) {
   loop();
 }
 
+TEST(gui_test, restoring_main_screen) {
+  Display d;
+  PersistentMemory pm(true, 1024);
+  PersistentMemoryWrapper mem(&pm, 1024);
+  PersistentState s(&mem);
+  mem.setup();
+  for (int i = 1; i <= 200; ++i)
+    s.rememberNewValue(i * 2);
+  s.rememberStartNewCount();
+  for (int i = 1; i <= 20; ++i)
+    s.rememberNewValue(i);
+  s.flush();
+  HAL h(&d, &mem);
+  expectSetup(h);
+  counter_gui::setup(&h);
+  expectBatteryDraw(d);
+  expectBatteryState(h, 0.5);
+
+  // the last values of the session are numbered within it
+  expectUpdateButtons(h, 123, false, false, false);
+  expectMainScreen(d, 20);
+  expectMainScreenHistory(
+      d, {"15.+1", "16.+1", "17.+1", "18.+1", "19.+1", "20.+1"});
+  expectMainScreenButtonAnimation(d, -1, -1, -1);
+  loop();
+}
+
+TEST(gui_test, current_count_history) {
+  Display d;
+  PersistentMemory pm(true, 1024);
+  PersistentMemoryWrapper mem(&pm, 1024);
+  PersistentState s(&mem);
+  mem.setup();
+  for (int i = 1; i <= 10; ++i)
+    s.rememberNewValue(i);
+  s.rememberStartNewCount();
+  for (int i = 1; i <= 5; ++i)
+    s.rememberNewValue(i * 2);
+  s.flush();
+  HAL h(&d, &mem);
+  expectSetup(h);
+  counter_gui::setup(&h);
+  expectBatteryDraw(d);
+  expectBatteryState(h, 0.5);
+
+  // menu, "show current count" item, select
+  int timestamp = 0;
+  pressAndReleaseButtonsIgnoreOutput(h, false, false, true, 100, 1, timestamp);
+  pressAndReleaseButtonsIgnoreOutput(h, false, true, false, 100, 1, timestamp);
+  pressAndReleaseButtonsIgnoreOutput(h, false, true, false, 100, 1, timestamp);
+  pressAndReleaseButtonsIgnoreOutput(h, false, false, true, 100, 1, timestamp);
+  // history starts from the new count, not from the oldest row
+  expectHistoryScreen(d, {"------", "11. 2=0+2", "12. 4=2+2", "13. 6=4+2",
+                          "14. 8=6+2", "15. 10=8+2"});
+  timestamp += 1;
+  expectUpdateButtons(h, timestamp, false, false, false);
+  loop();
+}
+
+TEST(gui_test, log_sync_keeps_awake) {
+  // line outlives the test, log sync stays set up for the next ones
+  static std::vector<uint8_t> line;
+  static int shipped = 0;
+  Display d;
+  PersistentMemory pm(true, 1024);
+  PersistentMemoryWrapper mem(&pm, 1024);
+  mem.setup();
+  PersistentState s(&mem);
+  for (int i = 1; i <= 20; ++i)
+    s.rememberNewValue(i * 1000);
+  s.flush();
+  HAL h(&d, &mem);
+  expectSetup(h);
+  counter_gui::setup(&h);
+  counter_gui::setupLogSync(
+      []() {
+        if (line.empty())
+          return -1;
+        int byte = line.front();
+        line.erase(line.begin());
+        return byte;
+      },
+      [](const uint8_t *, int len) { shipped += len; });
+  expectBatteryState(h, 0.5);
+  int timestamp = 5000;
+  expectUpdateButtons(h, timestamp, false, false, false);
+  counter_gui::update();
+  ASSERT_TRUE(counter_gui::canSleep());
+
+  // device stays awake while a request arrives and its answer is sent
+  uint8_t request[LogSync::max_request_size];
+  int len = LogSync::putRequest(request, 0);
+  line.push_back(request[0]);
+  counter_gui::update();
+  ASSERT_FALSE(counter_gui::canSleep());
+  line.insert(line.end(), request + 1, request + len);
+  shipped = 0;
+  int pieces = 0;
+  int last_piece = timestamp;
+  for (int previous = -1; shipped != previous;) {
+    previous = shipped;
+    timestamp += 20;
+    expectUpdateButtons(h, timestamp, false, false, false);
+    counter_gui::update();
+    ASSERT_FALSE(counter_gui::canSleep());
+    if (shipped != previous) {
+      pieces++;
+      last_piece = timestamp;
+    }
+  }
+  ASSERT_GT(pieces, 1);
+  // and for a while after, when the host asks for the next chunk
+  timestamp = last_piece + 999;
+  expectUpdateButtons(h, timestamp, false, false, false);
+  counter_gui::update();
+  ASSERT_FALSE(counter_gui::canSleep());
+  timestamp += 1;
+  expectUpdateButtons(h, timestamp, false, false, false);
+  counter_gui::update();
+  ASSERT_TRUE(counter_gui::canSleep());
+}
+
+TEST(gui_test, deferred_persistence) {
+  Display d;
+  PersistentMemory pm(true, 1024);
+  PersistentMemoryWrapper mem(&pm, 1024);
+  mem.setup();
+  HAL h(&d, &mem);
+  expectSetup(h);
+  counter_gui::setup(&h);
+  expectBatteryDraw(d);
+  expectBatteryState(h, 0.5);
+
+  // +1 and ok, change is queued and written once gui is idle
+  pm.resetCounters();
+  int timestamp = 0;
+  pressAndReleaseButtonsIgnoreOutput(h, true, false, false, 100, 1, timestamp);
+  pressAndReleaseButtonsIgnoreOutput(h, false, false, true, 100, 1, timestamp);
+  ASSERT_EQ(pm.bytesWritten(), 0);
+  timestamp += 1;
+  expectUpdateButtons(h, timestamp, false, false, false);
+  while (counter_gui::update())
+    ;
+  ASSERT_GT(pm.bytesWritten(), 0);
+  PersistentState restored(&mem);
+  int value = 0;
+  restored.restoreFromMem([&](int v, int) { value = v; }, []() { FAIL(); },
+                          []() { FAIL(); });
+  ASSERT_EQ(value, 1);
+}
+
 TEST(gui_test, delete_history) {
   Display d;
   PersistentMemory pm(true, 1024);
   PersistentMemoryWrapper mem(&pm, 1024);
+  // full history is kept in persistent memory only
+  mem.setup();
   HAL h(&d, &mem);
   expectSetup(h);
   counter_gui::setup(&h);
@@ -549,6 +718,7 @@ TEST(gui_test, delete_history) {
   pressAndReleaseButtonsIgnoreOutput(h, false, true, false, 100, 1, timestamp);
   pressAndReleaseButtonsIgnoreOutput(h, false, true, false, 100, 1, timestamp);
   pressAndReleaseButtonsIgnoreOutput(h, false, true, false, 100, 1, timestamp);
+  pressAndReleaseButtonsIgnoreOutput(h, false, true, false, 100, 1, timestamp);
 
   // click "delete history"
   pressAndReleaseButtonsIgnoreOutput(h, false, false, true, 100, 1, timestamp);
@@ -559,6 +729,7 @@ TEST(gui_test, delete_history) {
   // move up in menu to history item
   pressAndReleaseButtonsIgnoreOutput(h, true, false, false, 100, 1, timestamp);
   pressAndReleaseButtonsIgnoreOutput(h, true, false, false, 100, 1, timestamp);
+  pressAndReleaseButtonsIgnoreOutput(h, true, false, false, 100, 1, timestamp);
 
   // got to history
   pressAndReleaseButtonsIgnoreOutput(h, false, false, true, 100, 1, timestamp);
@@ -593,6 +764,8 @@ TEST(gui_test, new_count) {
   Display d;
   PersistentMemory pm(true, 1024);
   PersistentMemoryWrapper mem(&pm, 1024);
+  // full history is kept in persistent memory only
+  mem.setup();
   HAL h(&d, &mem);
   expectSetup(h);
   counter_gui::setup(&h);
@@ -619,6 +792,7 @@ TEST(gui_test, new_count) {
   // goto "new count" item
   pressAndReleaseButtonsIgnoreOutput(h, false, true, false, 100, 1, timestamp);
   pressAndReleaseButtonsIgnoreOutput(h, false, true, false, 100, 1, timestamp);
+  pressAndReleaseButtonsIgnoreOutput(h, false, true, false, 100, 1, timestamp);
 
   // click "new count"
   pressAndReleaseButtonsIgnoreOutput(h, false, false, true, 100, 1, timestamp);
@@ -626,7 +800,8 @@ TEST(gui_test, new_count) {
   // confirm
   pressAndReleaseButtonsIgnoreOutput(h, true, false, false, 100, 1, timestamp);
 
-  // move up in menu
+  // move up in menu to "show full history"
+  pressAndReleaseButtonsIgnoreOutput(h, true, false, false, 100, 1, timestamp);
   pressAndReleaseButtonsIgnoreOutput(h, true, false, false, 100, 1, timestamp);
 
   // got to history
@@ -698,11 +873,68 @@ TEST(state_test, repeating_button_test) {
   checkTimestamp(1600, false, -1);
 }
 
+TEST(state_test, persistent_memory_block_access) {
+  PersistentMemory raw_mem(true, 16);
+  PersistentMemoryWrapper mem(&raw_mem, 16);
+  mem.setup();
+  uint8_t data[40];
+  for (int i = 0; i < 40; ++i)
+    data[i] = i + 1;
+  // wraps around the end of memory
+  mem.writeBlock(12, data, 8);
+  for (int i = 0; i < 8; ++i)
+    ASSERT_EQ(mem.read((12 + i) % 16), i + 1);
+  uint8_t read_back[16] = {0};
+  mem.readBlock(28, read_back, 8);
+  for (int i = 0; i < 8; ++i)
+    ASSERT_EQ(read_back[i], i + 1);
+  // whole memory in one call starting from the middle
+  mem.writeBlock(5, data, 16);
+  mem.readBlock(5, read_back, 16);
+  for (int i = 0; i < 16; ++i)
+    ASSERT_EQ(read_back[i], i + 1);
+}
+
+TEST(state_test, persistent_memory_stats) {
+  PersistentMemory raw_mem(true, 1024);
+  PersistentMemoryWrapper mem(&raw_mem, 1024);
+  mem.setup();
+  ASSERT_EQ(mem.wearBucketSize(), 16);
+  uint8_t data[100] = {0};
+  // wraps around the end, split into 32 byte transactions
+  mem.writeBlock(1000, data, 100);
+  mem.readBlock(0, data, 70);
+  mem.write(5, 1);
+  const PersistentMemoryWrapper::Stats &stats = mem.stats();
+  ASSERT_EQ(stats.writes, 5);
+  ASSERT_EQ(stats.bytes_written, 101);
+  ASSERT_EQ(stats.reads, 3);
+  ASSERT_EQ(stats.bytes_read, 70);
+  ASSERT_EQ(stats.erases, 0);
+  ASSERT_EQ(stats.wear[62], 8);
+  ASSERT_EQ(stats.wear[63], 16);
+  ASSERT_EQ(stats.wear[0], 17);
+  ASSERT_EQ(stats.wear[4], 12);
+  ASSERT_EQ(stats.wear[5], 0);
+  mem.resetStats();
+  ASSERT_EQ(mem.stats().bytes_written, 0);
+  ASSERT_EQ(mem.stats().wear[0], 0);
+
+  FlashMemory flash(1024, 256);
+  FlashMemoryWrapper flash_mem(&flash, 1024);
+  flash_mem.setup();
+  flash_mem.erase(0, 512);
+  flash_mem.writeBlock(0, data, 100);
+  ASSERT_EQ(flash_mem.stats().erases, 1);
+  ASSERT_EQ(flash_mem.stats().writes, 2);
+  ASSERT_EQ(flash_mem.stats().bytes_written, 100);
+}
+
 TEST(state_test, persisten_state_test1) {
-  PersistentMemory raw_mem(true, 32);
-  PersistentMemoryWrapper mem(&raw_mem, 32);
+  PersistentMemory raw_mem(true, 128);
+  PersistentMemoryWrapper mem(&raw_mem, 128);
   mem.setup();
-  PersistentState s1(&mem);
+  PersistentState s1(&mem, 64);
   s1.restoreFromMem([](int, int) { FAIL(); }, []() { FAIL(); },
                     []() { FAIL(); });
   for (int i = 0; i < 5; ++i)
@@ -711,7 +943,8 @@ TEST(state_test, persisten_state_test1) {
   s1.rememberStartNewCount();
   s1.rememberNewValue(32);
   s1.rememberClearHistory();
-  PersistentState s2(&mem);
+  s1.flush();
+  PersistentState s2(&mem, 64);
   int sum = 0;
   int new_counts = 0;
   int resets = 0;
@@ -723,10 +956,10 @@ TEST(state_test, persisten_state_test1) {
 }
 
 TEST(state_test, persisten_state_test2) {
-  PersistentMemory raw_mem(true, 16);
-  PersistentMemoryWrapper mem(&raw_mem, 16);
+  PersistentMemory raw_mem(true, 128);
+  PersistentMemoryWrapper mem(&raw_mem, 128);
   mem.setup();
-  PersistentState s1(&mem);
+  PersistentState s1(&mem, 64);
   // add some garbage
   mem.write(0, 5);
   mem.write(1, 25);
@@ -739,7 +972,8 @@ TEST(state_test, persisten_state_test2) {
   s1.rememberStartNewCount();
   s1.rememberNewValue(13);
   s1.rememberStartNewCount();
-  PersistentState s2(&mem);
+  s1.flush();
+  PersistentState s2(&mem, 64);
   int sum = 0;
   int new_counts = 0;
   int resets = 0;
@@ -751,10 +985,10 @@ TEST(state_test, persisten_state_test2) {
 }
 
 TEST(state_test, persisten_state_end_spoiling_test) {
-  PersistentMemory raw_mem(true, 16);
-  PersistentMemoryWrapper mem(&raw_mem, 16);
+  PersistentMemory raw_mem(true, 128);
+  PersistentMemoryWrapper mem(&raw_mem, 128);
   mem.setup();
-  PersistentState s(&mem);
+  PersistentState s(&mem, 64);
   s.restoreFromMem([](int, int) { FAIL(); }, []() { FAIL(); },
                    []() { FAIL(); });
   s.rememberNewValue(1);
@@ -766,32 +1000,42 @@ TEST(state_test, persisten_state_end_spoiling_test) {
 }
 
 TEST(state_test, persisten_state_overflow_test1) {
-  PersistentMemory raw_mem(true, 16);
-  PersistentMemoryWrapper mem(&raw_mem, 16);
+  PersistentMemory raw_mem(true, 128);
+  PersistentMemoryWrapper mem(&raw_mem, 128);
   mem.setup();
-  PersistentState s1(&mem);
+  PersistentState s1(&mem, 64);
   s1.restoreFromMem([](int, int) { FAIL(); }, []() { FAIL(); },
                     []() { FAIL(); });
   for (int repeat = 0; repeat < 16; ++repeat) {
     for (int i = 0; i < 10; ++i)
       s1.rememberNewValue(1 << i);
-    PersistentState s2(&mem);
-    int sum = 0;
+    s1.flush();
+    PersistentState s2(&mem, 64);
+    // oldest page is dropped, but restored values are the tail of
+    // written ones and deltas are consistent with checkpointed value
+    std::vector<int> values;
     int new_counts = 0;
     int resets = 0;
-    s2.restoreFromMem([&](int value, int delta) { sum += value; },
-                      [&]() { resets++; }, [&]() { new_counts++; });
-    ASSERT_EQ(sum, 960);
+    s2.restoreFromMem(
+        [&](int value, int delta) {
+          if (!values.empty())
+            ASSERT_EQ(value - delta, values.back());
+          values.push_back(value);
+        },
+        [&]() { resets++; }, [&]() { new_counts++; });
+    ASSERT_GE(values.size(), 6);
+    for (int i = 0; i < values.size(); ++i)
+      ASSERT_EQ(values[values.size() - 1 - i], 1 << ((9 - i + 100) % 10));
     ASSERT_EQ(new_counts, 0);
     ASSERT_EQ(resets, 0);
   }
 }
 
 TEST(state_test, persisten_state_overflow_test2) {
-  PersistentMemory raw_mem(true, 16);
-  PersistentMemoryWrapper mem(&raw_mem, 16);
+  PersistentMemory raw_mem(true, 128);
+  PersistentMemoryWrapper mem(&raw_mem, 128);
   mem.setup();
-  PersistentState s1(&mem);
+  PersistentState s1(&mem, 64);
   s1.restoreFromMem([](int, int) { FAIL(); }, []() { FAIL(); },
                     []() { FAIL(); });
   for (int repeat = 0; repeat < 16; ++repeat) {
@@ -800,15 +1044,1574 @@ TEST(state_test, persisten_state_overflow_test2) {
     for (int i = 0; i < 3; ++i)
       s1.rememberNewValue(1 << i);
     s1.rememberStartNewCount();
-    PersistentState s2(&mem);
+    s1.flush();
+    PersistentState s2(&mem, 64);
     int sum = 0;
     int new_counts = 0;
     int resets = 0;
+    // previous repetition may partially survive, count since last reset
     s2.restoreFromMem([&](int value, int delta) { sum += value; },
-                      [&]() { resets++; }, [&]() { new_counts++; });
+                      [&]() {
+                        resets++;
+                        sum = 0;
+                        new_counts = 0;
+                      },
+                      [&]() { new_counts++; });
     ASSERT_EQ(sum, 7);
-    ASSERT_GE(new_counts, 2);
-    ASSERT_EQ(resets, 1);
+    ASSERT_EQ(new_counts, 2);
+    ASSERT_GE(resets, 1);
+  }
+}
+
+TEST(state_test, persistent_state_head_lookup) {
+  PersistentMemory raw_mem(true, 1024);
+  PersistentMemoryWrapper mem(&raw_mem, 1024);
+  mem.setup();
+  PersistentState s1(&mem, 64);
+  s1.restoreFromMem([](int, int) { FAIL(); }, []() { FAIL(); },
+                    []() { FAIL(); });
+  // several laps around the ring, head is found at every position
+  for (int i = 1; i <= 400; ++i) {
+    s1.rememberNewValue(i);
+    s1.flush();
+    PersistentState s2(&mem, 64);
+    int last = 0;
+    int restored = 0;
+    s2.restoreFromMem(
+        [&](int value, int) {
+          if (restored > 0)
+            ASSERT_EQ(value, last + 1);
+          last = value;
+          restored++;
+        },
+        []() { FAIL(); }, []() { FAIL(); });
+    ASSERT_EQ(last, i);
+    // the archive takes 8 of the 16 pages, restore replays the other 8
+    // log pages, at least 7 of them full
+    ASSERT_GE(restored, std::min(i, 16 * 6));
+  }
+}
+
+TEST(state_test, persistent_state_checkpoint_restore) {
+  PersistentMemory raw_mem(true, 4096);
+  PersistentMemoryWrapper mem(&raw_mem, 4096);
+  mem.setup();
+  PersistentState s1(&mem);
+  s1.restoreFromMem([](int, int) { FAIL(); }, []() { FAIL(); },
+                    []() { FAIL(); });
+  int value = 0;
+  for (int i = 1; i <= 500; ++i) {
+    if (i % 100 == 50) {
+      s1.rememberStartNewCount();
+      value = 0;
+    } else {
+      value += i % 7;
+      s1.rememberNewValue(value);
+    }
+  }
+  s1.rememberNewValue(++value);
+
+  // replay starts from the checkpoint covering last 20 records
+  s1.flush();
+  PersistentState s2(&mem);
+  PersistentState::Checkpoint start;
+  int replayed = 0;
+  int restored_value = 0;
+  int session_items = 0;
+  s2.restoreFromMem(
+      20,
+      [&](const PersistentState::Checkpoint &cp) {
+        start = cp;
+        restored_value = cp.value;
+        session_items = cp.session_items;
+      },
+      [&](int value, int delta) {
+        ASSERT_EQ(value - delta, restored_value);
+        restored_value = value;
+        session_items++;
+        replayed++;
+      },
+      []() { FAIL(); }, []() { FAIL(); });
+  ASSERT_GE(replayed, 20);
+  ASSERT_LT(replayed, 20 + PersistentState::default_page_size / 3);
+  ASSERT_EQ(start.events + replayed, 501);
+  ASSERT_EQ(start.history_items + replayed, 496);
+  ASSERT_EQ(session_items, 51);
+  ASSERT_EQ(restored_value, value);
+}
+
+TEST(state_test, persistent_state_visible_restore) {
+  PersistentMemory raw_mem(true, 4096);
+  PersistentMemoryWrapper mem(&raw_mem, 4096);
+  mem.setup();
+  PersistentState s(&mem);
+  s.restoreFromMem([](int, int) {}, []() {}, []() {});
+  for (int i = 1; i <= 1000; ++i)
+    s.rememberNewValue(i);
+  s.rememberClearHistory();
+  for (int i = 1; i <= 3; ++i)
+    s.rememberNewValue(i * 2);
+  s.flush();
+
+  // nothing before the history clear is replayed
+  auto restore = [&](int min_events, PersistentState::Checkpoint &start) {
+    std::vector<int> values;
+    PersistentState restored(&mem);
+    raw_mem.resetCounters();
+    restored.restoreFromMem(
+        min_events,
+        [&](const PersistentState::Checkpoint &cp) { start = cp; },
+        [&](int value, int) { values.push_back(value); }, []() { FAIL(); },
+        []() { FAIL(); });
+    return values;
+  };
+  PersistentState::Checkpoint start;
+  ASSERT_EQ(restore(8, start), std::vector<int>({2, 4, 6}));
+  ASSERT_EQ(start.events, 1001);
+  ASSERT_EQ(start.value, 0);
+  ASSERT_EQ(start.history_items, 0);
+  // records before the clear are not even read
+  const int visible_bytes = raw_mem.bytesRead();
+  PersistentState full(&mem);
+  raw_mem.resetCounters();
+  full.restoreFromMem([](int, int) {}, []() {}, []() {});
+  ASSERT_LT(visible_bytes, raw_mem.bytesRead() / 2);
+
+  // the same for new count, at most min_events values are replayed
+  s.rememberStartNewCount();
+  for (int i = 1; i <= 100; ++i)
+    s.rememberNewValue(i);
+  s.flush();
+  std::vector<int> values = restore(8, start);
+  ASSERT_EQ(values.size(), 8);
+  ASSERT_EQ(values.back(), 100);
+  ASSERT_EQ(start.value, 92);
+  ASSERT_EQ(start.session_items, 92);
+  ASSERT_EQ(start.history_items, 95);
+  ASSERT_EQ(restore(0, start).size(), 0);
+  ASSERT_EQ(start.value, 100);
+}
+
+TEST(state_test, memory_window) {
+  PersistentMemory raw_mem(true, 200);
+  PersistentMemoryWrapper mem(&raw_mem, 200);
+  mem.setup();
+  for (int i = 0; i < 200; ++i)
+    mem.write(i, i);
+  MemoryWindow window(&mem);
+  // sequential access crossing chunks and the end of memory
+  for (int addr = 150; addr < 450; ++addr)
+    ASSERT_EQ(window[addr], addr % 200);
+  // random access
+  for (int addr : {5, 199, 0, 64, 63, 128})
+    ASSERT_EQ(window[addr], addr);
+
+  // power of two sizes wrap with a mask
+  PersistentMemory raw_mem2(true, 256);
+  PersistentMemoryWrapper mem2(&raw_mem2, 256);
+  mem2.setup();
+  for (int i = 0; i < 256; ++i)
+    mem2.write(i, 255 - i);
+  MemoryWindow window2(&mem2);
+  for (int addr : {250, 255, 256, 300, 3, 511, 1000})
+    ASSERT_EQ(window2[addr], 255 - addr % 256);
+}
+
+TEST(state_test, persistent_state_large_pages) {
+  PersistentMemory raw_mem(true, 2048);
+  PersistentMemoryWrapper mem(&raw_mem, 2048);
+  mem.setup();
+  PersistentState s1(&mem, 512);
+  s1.restoreFromMem([](int, int) { FAIL(); }, []() { FAIL(); },
+                    []() { FAIL(); });
+  // records straddle window chunks inside the pages
+  for (int i = 1; i <= 500; ++i)
+    s1.rememberNewValue(i);
+  s1.flush();
+  PersistentState s2(&mem, 512);
+  int expected = 0;
+  s2.restoreFromMem(
+      [&](int value, int delta) {
+        if (expected == 0)
+          expected = value;
+        ASSERT_EQ(value, expected);
+        ASSERT_EQ(delta, 1);
+        expected++;
+      },
+      []() { FAIL(); }, []() { FAIL(); });
+  ASSERT_EQ(expected, 501);
+}
+
+TEST(state_test, persistent_state_delta_encoding) {
+  PersistentMemory raw_mem(true, 1024);
+  PersistentMemoryWrapper mem(&raw_mem, 1024);
+  mem.setup();
+  PersistentState s1(&mem);
+  s1.restoreFromMem([](int, int) { FAIL(); }, []() { FAIL(); },
+                    []() { FAIL(); });
+  // values do not fit into int16 anymore
+  std::vector<int> values = {1, -63, 1, 64, 100000, -70000, 2000000000, 0};
+  for (int v : values)
+    s1.rememberNewValue(v);
+  s1.flush();
+  PersistentState s2(&mem);
+  std::vector<int> restored;
+  s2.restoreFromMem([&](int value, int delta) { restored.push_back(value); },
+                    []() { FAIL(); }, []() { FAIL(); });
+  ASSERT_EQ(restored, values);
+
+  // small deltas take one byte plus time and crc in the 4 log pages of
+  // 1KB memory, the archive keeps about a byte per event in the other 4
+  int value = 0;
+  for (int i = 0; i < 2000; ++i) {
+    value += i % 41 - 20;
+    s1.rememberNewValue(value);
+  }
+  s1.flush();
+  PersistentState s3(&mem);
+  int count = 0;
+  int last_value = 0;
+  s3.restoreFromMem(
+      [&](int value, int delta) {
+        count++;
+        last_value = value;
+      },
+      []() { FAIL(); }, []() { FAIL(); });
+  ASSERT_EQ(last_value, value);
+  ASSERT_GE(count, 3 * 128 / 4);
+  ASSERT_GE(s3.historySize(), 2 * 6 * 128 / 4);
+}
+
+TEST(state_test, persistent_state_torn_record) {
+  PersistentMemory raw_mem(true, 256);
+  PersistentMemoryWrapper mem(&raw_mem, 256);
+  mem.setup();
+  PersistentState s(&mem, 64);
+  s.restoreFromMem([](int, int) { FAIL(); }, []() { FAIL(); },
+                   []() { FAIL(); });
+  // long records, some of them open new pages and wrap the ring
+  for (int i = 1; i <= 60; ++i) {
+    int value = i % 2 ? i : 100000 * i;
+    int previous_value = i % 2 ? 100000 * (i - 1) : i - 1;
+    uint8_t before[256];
+    mem.readBlock(0, before, 256);
+    s.rememberNewValue(value);
+    s.flush();
+
+    // power is lost after some bytes of the append reached memory
+    for (int limit = 0;; ++limit) {
+      PersistentMemory torn_raw_mem(true, 256);
+      PersistentMemoryWrapper torn_mem(&torn_raw_mem, 256);
+      torn_mem.setup();
+      torn_mem.writeBlock(0, before, 256);
+      PersistentState torn(&torn_mem, 64);
+      torn.restoreFromMem([](int, int) {}, []() { FAIL(); }, []() { FAIL(); });
+      torn_raw_mem.setWriteLimit(limit);
+      torn.rememberNewValue(value);
+      torn.flush();
+      torn_raw_mem.setWriteLimit(-1);
+      uint8_t torn_image[256];
+      torn_mem.readBlock(0, torn_image, 256);
+      uint8_t after[256];
+      mem.readBlock(0, after, 256);
+      bool complete = std::equal(torn_image, torn_image + 256, after);
+
+      PersistentState restored(&torn_mem, 64);
+      int last = 0;
+      restored.restoreFromMem([&](int value, int) { last = value; },
+                              []() { FAIL(); }, []() { FAIL(); });
+      ASSERT_EQ(last, complete ? value : previous_value);
+      // only torn tail is dropped, with a single byte write at most
+      uint8_t recovered[256];
+      torn_mem.readBlock(0, recovered, 256);
+      int changed = 0;
+      for (int i = 0; i < 256; ++i)
+        changed += recovered[i] != torn_image[i];
+      ASSERT_LE(changed, 1);
+
+      restored.rememberNewValue(-1);
+      restored.flush();
+      PersistentState s2(&torn_mem, 64);
+      std::vector<int> values;
+      s2.restoreFromMem([&](int value, int) { values.push_back(value); },
+                        []() { FAIL(); }, []() { FAIL(); });
+      ASSERT_EQ(values.back(), -1);
+      if (complete)
+        break;
+      if (i > 1) {
+        ASSERT_GE(values.size(), 2);
+        ASSERT_EQ(values[values.size() - 2], previous_value);
+      }
+    }
+  }
+}
+
+TEST(state_test, persistent_state_append_cost) {
+  PersistentMemory raw_mem(true, 256);
+  PersistentMemoryWrapper mem(&raw_mem, 256);
+  mem.setup();
+  PersistentState s(&mem, 64);
+  s.restoreFromMem([](int, int) { FAIL(); }, []() { FAIL(); },
+                   []() { FAIL(); });
+  auto cost = [&](std::function<void()> event) {
+    raw_mem.resetCounters();
+    mem.resetStats();
+    event();
+    EXPECT_EQ(raw_mem.bytesWritten(), 0);
+    s.flush();
+    EXPECT_EQ(raw_mem.bytesRead(), 0);
+    // the tail and then the first byte
+    EXPECT_EQ(mem.stats().writes, 2);
+    return raw_mem.bytesWritten();
+  };
+  // page 0 header takes 12 bytes, records are followed by time, crc
+  // and end mark
+  for (int i = 1; i <= 11; ++i)
+    ASSERT_EQ(cost([&]() { s.rememberNewValue(i); }), 3 + 1);
+  ASSERT_EQ(cost([&]() { s.rememberClearHistory(); }), 1 + 1 + 1 + 1);
+  ASSERT_EQ(cost([&]() { s.rememberStartNewCount(); }), 1 + 1 + 1 + 1);
+  // zigzag(1000) takes two varint bytes
+  ASSERT_EQ(cost([&]() { s.rememberNewValue(1000); }), 1 + 2 + 1 + 1 + 1);
+  // record fills the page exactly, no room for end mark
+  ASSERT_EQ(cost([&]() { s.rememberNewValue(-200000000); }), 1 + 5 + 1 + 1);
+  // new page header: seq, events, value, history, session, history records,
+  // time, sessions and crc
+  ASSERT_EQ(cost([&]() { s.rememberNewValue(1002); }),
+            4 + 1 + 5 + 1 + 1 + 1 + 1 + 1 + 1 + 1 + 5 + 1 + 1 + 1);
+}
+
+TEST(state_test, persistent_state_deferred_write) {
+  PersistentMemory raw_mem(true, 256);
+  PersistentMemoryWrapper mem(&raw_mem, 256);
+  mem.setup();
+  PersistentState s(&mem, 64);
+  s.restoreFromMem([](int, int) { FAIL(); }, []() { FAIL(); },
+                   []() { FAIL(); });
+  const int max_pending = PersistentState::max_pending_events;
+  auto restore = [&]() {
+    std::vector<int> events;
+    PersistentState restored(&mem, 64);
+    restored.restoreFromMem([&](int value, int) { events.push_back(value); },
+                            [&]() { events.push_back(-1); },
+                            [&]() { events.push_back(-2); });
+    return events;
+  };
+
+  // events wait in RAM, group is written with one end mark
+  raw_mem.resetCounters();
+  s.rememberNewValue(1);
+  s.rememberStartNewCount();
+  s.rememberNewValue(2);
+  ASSERT_EQ(s.pendingEvents(), 3);
+  ASSERT_EQ(raw_mem.bytesWritten(), 0);
+  ASSERT_EQ(restore(), std::vector<int>());
+  s.flush();
+  ASSERT_EQ(s.pendingEvents(), 0);
+  ASSERT_EQ(raw_mem.bytesWritten(), 3 * 3 + 1);
+  ASSERT_EQ(restore(), std::vector<int>({1, -2, 2}));
+
+  // full queue is flushed before the next event, so at most
+  // max_pending_events events are lost
+  std::vector<int> expected = {1, -2, 2};
+  for (int i = 0; i < max_pending + 3; ++i) {
+    int value = i % 4 ? 100000 * i : 3;
+    s.rememberNewValue(value);
+    expected.push_back(value);
+  }
+  s.rememberClearHistory();
+  expected.push_back(-1);
+  ASSERT_EQ(s.pendingEvents(), 4);
+  ASSERT_EQ(restore(), std::vector<int>(expected.begin(), expected.end() - 4));
+
+  // batch continues in the next pages, order is kept
+  for (int i = 0; i < max_pending - 4; ++i) {
+    s.rememberNewValue(-100000 * i);
+    expected.push_back(-100000 * i);
+  }
+  s.flush();
+  std::vector<int> restored = restore();
+  ASSERT_LE(restored.size(), expected.size());
+  ASSERT_TRUE(std::equal(restored.begin(), restored.end(),
+                         expected.end() - restored.size()));
+  ASSERT_GE(restored.size(), max_pending);
+}
+
+TEST(state_test, flash_memory_wrapper) {
+  FlashMemory flash(1024, 256);
+  FlashMemoryWrapper mem(&flash, 1024);
+  mem.setup();
+  ASSERT_TRUE(mem.isValid());
+  ASSERT_EQ(mem.eraseSize(), 256);
+  // erased flash reads as zeros
+  ASSERT_EQ(mem.read(300), 0);
+  uint8_t data[] = {1, 2, 0x80, 0xff};
+  mem.writeBlock(1022, data, 4);
+  uint8_t read_back[4];
+  mem.readBlock(1022, read_back, 4);
+  ASSERT_TRUE(std::equal(data, data + 4, read_back));
+  // programming could only add bits of logical value
+  mem.write(1022, 2);
+  ASSERT_EQ(mem.read(1022), 3);
+  mem.erase(768, 256);
+  ASSERT_EQ(mem.read(1022), 0);
+  ASSERT_EQ(mem.read(0), 0x80);
+  ASSERT_EQ(flash.eraseCount(3), 1);
+  ASSERT_EQ(flash.eraseCount(0), 0);
+
+  FlashMemoryWrapper too_large(&flash, 2048);
+  too_large.setup();
+  ASSERT_FALSE(too_large.isValid());
+}
+
+TEST(state_test, persistent_state_flash_backend) {
+  FlashMemory flash(2048, 256);
+  FlashMemoryWrapper mem(&flash, 2048);
+  mem.setup();
+  PersistentState s;
+  s.setup(&mem);
+  s.restoreFromMem([](int, int) { FAIL(); }, []() { FAIL(); },
+                   []() { FAIL(); });
+  flash.resetCounters();
+  // several laps around the ring
+  const int events = 3000;
+  for (int i = 1; i <= events; ++i) {
+    s.rememberNewValue(i);
+    if (i % 3 == 0)
+      s.flush();
+    if (i % 101 == 0) {
+      PersistentState restored;
+      restored.setup(&mem);
+      int last = 0;
+      restored.restoreFromMem(
+          [&](int value, int delta) {
+            if (last != 0)
+              ASSERT_EQ(value, last + 1);
+            ASSERT_EQ(delta, 1);
+            last = value;
+          },
+          []() { FAIL(); }, []() { FAIL(); });
+      ASSERT_EQ(last, i / 3 * 3);
+    }
+  }
+  // every block is erased in turn
+  int min_erases = events;
+  int max_erases = 0;
+  for (int block = 0; block < 8; ++block) {
+    min_erases = std::min(min_erases, flash.eraseCount(block));
+    max_erases = std::max(max_erases, flash.eraseCount(block));
+  }
+  ASSERT_GE(min_erases, 2);
+  ASSERT_LE(max_erases - min_erases, 1);
+  // each event takes a record with time and crc, batch adds an end mark,
+  // page headers add less than 10% more, every byte is programmed once
+  ASSERT_LE(flash.bytesProgrammed(), events * 3 * 11 / 10 + events / 3);
+  ASSERT_EQ(flash.bytesOverwritten(), 0);
+}
+
+TEST(state_test, persistent_state_flash_interrupted_append) {
+  FlashMemory flash(1024, 256);
+  FlashMemoryWrapper mem(&flash, 1024);
+  mem.setup();
+  PersistentState s;
+  s.setup(&mem);
+  s.restoreFromMem([](int, int) { FAIL(); }, []() { FAIL(); },
+                   []() { FAIL(); });
+  s.rememberNewValue(1);
+  s.flush();
+  // append was interrupted before its first byte was programmed
+  uint8_t garbage[] = {0x12, 0x34};
+  mem.writeBlock(40, garbage, 2);
+  // erase of the next page was interrupted
+  mem.erase(256, 256);
+
+  PersistentState s2;
+  s2.setup(&mem);
+  std::vector<int> values;
+  s2.restoreFromMem([&](int value, int) { values.push_back(value); },
+                    []() { FAIL(); }, []() { FAIL(); });
+  ASSERT_EQ(values, std::vector<int>({1}));
+  s2.rememberNewValue(2);
+  s2.flush();
+  PersistentState s3;
+  s3.setup(&mem);
+  values.clear();
+  s3.restoreFromMem([&](int value, int) { values.push_back(value); },
+                    []() { FAIL(); }, []() { FAIL(); });
+  ASSERT_EQ(values, std::vector<int>({1, 2}));
+}
+
+TEST(state_test, file_backed_persistent_memory) {
+  std::string path = testing::TempDir() + "counter_image.bin";
+  std::remove(path.c_str());
+  {
+    PersistentMemory raw_mem(path.c_str(), 4096);
+    PersistentMemoryWrapper mem(&raw_mem, 4096);
+    mem.setup();
+    ASSERT_TRUE(mem.isValid());
+    PersistentState s(&mem);
+    s.restoreFromMem([](int, int) { FAIL(); }, []() { FAIL(); },
+                     []() { FAIL(); });
+    for (int i = 1; i <= 100; ++i)
+      s.rememberNewValue(i);
+    s.flush();
+  }
+  // next run of simulated device
+  PersistentMemory raw_mem(path.c_str(), 4096);
+  PersistentMemoryWrapper mem(&raw_mem, 4096);
+  mem.setup();
+  PersistentState s(&mem);
+  int last = 0;
+  s.restoreFromMem([&](int value, int) { last = value; }, []() { FAIL(); },
+                   []() { FAIL(); });
+  ASSERT_EQ(last, 100);
+  std::remove(path.c_str());
+
+  PersistentMemory missing("/nonexistent/counter_image.bin", 4096);
+  ASSERT_FALSE(missing.begin());
+}
+
+TEST(state_test, persistent_state_restore_scaling) {
+  // head lookup is logarithmic and bounded restore replays the same
+  // number of events whatever the image size is
+  std::string path = testing::TempDir() + "counter_scaling.bin";
+  std::vector<int> bytes_read;
+  for (int size : {1 << 10, 32 << 10, 4 << 20}) {
+    std::remove(path.c_str());
+    PersistentMemory raw_mem(path.c_str(), size);
+    PersistentMemoryWrapper mem(&raw_mem, size);
+    mem.setup();
+    PersistentState s(&mem);
+    s.restoreFromMem([](int, int) { FAIL(); }, []() { FAIL(); },
+                     []() { FAIL(); });
+    for (int i = 1; i <= 5000; ++i)
+      s.rememberNewValue(i % 2 ? i : -i);
+    s.flush();
+
+    raw_mem.resetCounters();
+    PersistentState restored(&mem);
+    int events = 0;
+    int last = 0;
+    restored.restoreFromMem(
+        64, [](const PersistentState::Checkpoint &) {},
+        [&](int value, int) {
+          events++;
+          last = value;
+        },
+        []() { FAIL(); }, []() { FAIL(); });
+    ASSERT_EQ(last, -5000);
+    ASSERT_GE(events, 64);
+    ASSERT_LE(events, 64 + PersistentState::default_page_size / 2);
+    bytes_read.push_back(raw_mem.bytesRead());
+  }
+  std::remove(path.c_str());
+  // 4096 times larger image costs only a few more header reads
+  ASSERT_LE(bytes_read[2], bytes_read[0] * 4);
+}
+
+// step of scripted event sequence for power cut harness
+struct ScriptStep {
+  enum Op { Value, ClearHistory, NewCount, Flush } op;
+  int value;
+};
+
+// restored events: values are kept as is, history clear is -1, new count -2
+std::vector<int> restoreEvents(PersistentMemoryWrapper &mem, int page_size) {
+  std::vector<int> events;
+  PersistentState s(&mem, page_size);
+  s.restoreFromMem([&](int value, int) { events.push_back(value); },
+                   [&]() { events.push_back(-1); },
+                   [&]() { events.push_back(-2); });
+  return events;
+}
+
+// recovery cost after a power cut
+struct CutRecovery {
+  int cut; // bytes written before the cut
+  int bytes_read;
+  int bytes_written;
+  double recovery_us;
+};
+
+struct PowerCutReport {
+  std::vector<CutRecovery> cuts;
+  int max_recovery_bytes_read = 0;
+  int max_recovery_bytes_written = 0;
+  double max_recovery_us = 0;
+};
+
+// Plays the script cutting power after every written byte, so every write
+// call boundary and every partial write is covered. Restored events must
+// be the tail of some prefix of the script, which contains all events
+// flushed before the cut, or at least min_kept of them when they do not
+// fit the ring.
+PowerCutReport runWithPowerCuts(int mem_size, int page_size, int min_kept,
+                                const std::vector<ScriptStep> &script) {
+  PowerCutReport report;
+  for (int cut = 0;; ++cut) {
+    PersistentMemory raw_mem(true, mem_size);
+    PersistentMemoryWrapper mem(&raw_mem, mem_size);
+    mem.setup();
+    PersistentState s(&mem, page_size);
+    s.restoreFromMem([](int, int) {}, []() {}, []() {});
+    raw_mem.resetCounters();
+    raw_mem.setWriteLimit(cut);
+    std::vector<int> issued;
+    int durable = 0;
+    for (const ScriptStep &step : script) {
+      if (raw_mem.bytesWritten() > cut)
+        break; // device is off
+      switch (step.op) {
+      case ScriptStep::Value:
+        s.rememberNewValue(step.value);
+        issued.push_back(step.value);
+        break;
+      case ScriptStep::ClearHistory:
+        s.rememberClearHistory();
+        issued.push_back(-1);
+        break;
+      case ScriptStep::NewCount:
+        s.rememberStartNewCount();
+        issued.push_back(-2);
+        break;
+      case ScriptStep::Flush:
+        s.flush();
+        break;
+      }
+      if (raw_mem.bytesWritten() <= cut)
+        durable = issued.size() - s.pendingEvents();
+    }
+    bool completed = raw_mem.bytesWritten() <= cut;
+    raw_mem.setWriteLimit(-1);
+
+    raw_mem.resetCounters();
+    auto start = std::chrono::steady_clock::now();
+    std::vector<int> restored = restoreEvents(mem, page_size);
+    std::chrono::duration<double, std::micro> recovery_time =
+        std::chrono::steady_clock::now() - start;
+    report.cuts.push_back({cut, raw_mem.bytesRead(), raw_mem.bytesWritten(),
+                           recovery_time.count()});
+    report.max_recovery_bytes_read =
+        std::max(report.max_recovery_bytes_read, raw_mem.bytesRead());
+    report.max_recovery_bytes_written =
+        std::max(report.max_recovery_bytes_written, raw_mem.bytesWritten());
+    report.max_recovery_us =
+        std::max(report.max_recovery_us, recovery_time.count());
+
+    // an empty or short restore would be a tail of any prefix
+    EXPECT_GE(restored.size(), std::min(durable, min_kept))
+        << "power cut after " << cut << " bytes";
+    bool matches = false;
+    for (int k = durable; k <= issued.size() && !matches; ++k)
+      matches = restored.size() <= k &&
+                std::equal(restored.begin(), restored.end(),
+                           issued.begin() + k - restored.size());
+    EXPECT_TRUE(matches) << "power cut after " << cut << " bytes";
+    // log keeps working after recovery
+    PersistentState next(&mem, page_size);
+    next.restoreFromMem([](int, int) {}, []() {}, []() {});
+    next.rememberNewValue(12345);
+    next.flush();
+    std::vector<int> extended = restoreEvents(mem, page_size);
+    EXPECT_EQ(extended.back(), 12345) << "power cut after " << cut << " bytes";
+    if (completed || testing::Test::HasFailure())
+      break;
+  }
+  return report;
+}
+
+TEST(state_test, persistent_state_power_cut_harness) {
+  std::vector<ScriptStep> script;
+  // long enough to wrap the ring a few times
+  for (int i = 1; i <= 100; ++i) {
+    script.push_back({ScriptStep::Value, i % 3 ? i : 1000000 * i});
+    if (i % 7 == 0)
+      script.push_back({ScriptStep::Flush, 0});
+    if (i % 13 == 0)
+      script.push_back({ScriptStep::NewCount, 0});
+    if (i == 60)
+      script.push_back({ScriptStep::ClearHistory, 0});
+  }
+  script.push_back({ScriptStep::Flush, 0});
+  // a full page of 64 bytes keeps at least 6 records of the script after
+  // its header, 3 of 4 pages are full after the ring wraps
+  PowerCutReport report = runWithPowerCuts(256, 64, 3 * 6, script);
+  // cost of every cut, as cut:bytes_read:microseconds
+  std::string costs;
+  for (const CutRecovery &c : report.cuts)
+    costs += std::to_string(c.cut) + ":" + std::to_string(c.bytes_read) +
+             ":" + std::to_string(static_cast<int>(c.recovery_us)) + " ";
+  RecordProperty("recovery_costs", costs);
+  RecordProperty("cuts", report.cuts.size());
+  RecordProperty("max_recovery_bytes_read", report.max_recovery_bytes_read);
+  RecordProperty("max_recovery_bytes_written",
+                 report.max_recovery_bytes_written);
+  RecordProperty("max_recovery_us", std::to_string(report.max_recovery_us));
+  ASSERT_GT(report.cuts.size(), 2 * 256);
+  // recovery only reads, torn appends are never visible
+  ASSERT_EQ(report.max_recovery_bytes_written, 0);
+  // head lookup and replay refetch windows, but stay within a few laps
+  ASSERT_LE(report.max_recovery_bytes_read, 4 * 256);
+
+  // memory large enough for the archive, 7 of 8 log pages are full
+  report = runWithPowerCuts(1024, 64, 7 * 6, script);
+  ASSERT_EQ(report.max_recovery_bytes_written, 0);
+}
+
+TEST(state_test, persistent_state_history_paging) {
+  PersistentMemory raw_mem(true, 4096);
+  PersistentMemoryWrapper mem(&raw_mem, 4096);
+  mem.setup();
+  PersistentState s(&mem);
+  s.restoreFromMem([](int, int) { FAIL(); }, []() { FAIL(); },
+                   []() { FAIL(); });
+  for (int i = 1; i <= 10; ++i)
+    s.rememberNewValue(i);
+  s.rememberClearHistory();
+  // new count starts every 50 values, history is deeper than 128 rows
+  int value = 0;
+  for (int i = 1; i <= 300; ++i) {
+    if (i % 50 == 0) {
+      s.rememberStartNewCount();
+      value = 0;
+    }
+    value += i;
+    s.rememberNewValue(value);
+  }
+  // pending events are part of the history
+  ASSERT_EQ(s.historySize(), 306);
+  ASSERT_EQ(s.pendingEvents(), 0);
+
+  PersistentState reader(&mem);
+  reader.restoreFromMem(1, nullptr, [](int, int) {}, []() {}, []() {});
+  ASSERT_EQ(reader.historySize(), 306);
+  std::vector<int> rows;
+  raw_mem.resetCounters();
+  reader.readHistory(
+      48, 4, [&](int i, const PersistentState::HistoryRecord &r) {
+        ASSERT_EQ(i, 48 + rows.size());
+        rows.push_back(r.new_count ? -1 : r.item_no);
+        if (r.item_no == 50)
+          ASSERT_EQ(r.value, 50);
+        if (r.item_no == 48)
+          ASSERT_EQ(r.delta, 48);
+      });
+  ASSERT_EQ(rows, std::vector<int>({49, -1, 50, 51}));
+  // header lookup and a page or two are read, not the whole log
+  ASSERT_LE(raw_mem.bytesRead(), 1024);
+  rows.clear();
+  reader.readHistory(300, 100,
+                     [&](int i, const PersistentState::HistoryRecord &) {
+                       rows.push_back(i);
+                     });
+  ASSERT_EQ(rows, std::vector<int>({300, 301, 302, 303, 304, 305}));
+
+  // history deeper than the log is kept compressed in the archive,
+  // but it is still limited by the oldest archive page
+  for (int i = 0; i < 20000; ++i)
+    s.rememberNewValue(i);
+  int size = s.historySize();
+  ASSERT_GT(size, 4096 / 2);
+  ASSERT_LT(size, 20000);
+  int row = 0;
+  s.readHistory(0, size, [&](int i, const PersistentState::HistoryRecord &r) {
+    ASSERT_EQ(i, row++);
+    ASSERT_EQ(r.value, i - (size - 20000));
+  });
+  ASSERT_EQ(row, size);
+  int item_no = 0;
+  s.readHistory(size - 1, 1,
+                [&](int, const PersistentState::HistoryRecord &r) {
+                  ASSERT_EQ(r.value, 19999);
+                  item_no = r.item_no;
+                });
+  ASSERT_EQ(item_no, 20300);
+}
+
+TEST(state_test, persistent_state_archive) {
+  // values grow by one with occasional jumps, new count every 40 values
+  std::vector<int> issued;
+  int value = 0;
+  for (int i = 1; i <= 1600; ++i) {
+    if (i % 40 == 0) {
+      issued.push_back(-2);
+      value = 0;
+    } else {
+      value = i % 7 == 0 ? value + i % 101 : value + 1;
+      issued.push_back(value);
+    }
+  }
+  // the shipped 1KB memory keeps half of its pages as the archive
+  PersistentMemory raw_mem(true, 1024);
+  PersistentMemoryWrapper mem(&raw_mem, 1024);
+  mem.setup();
+  PersistentState s(&mem);
+  s.restoreFromMem([](int, int) {}, []() {}, []() {});
+  for (int event : issued)
+    if (event == -2)
+      s.rememberStartNewCount();
+    else
+      s.rememberNewValue(event);
+  s.flush();
+
+  // restore decodes the log only, archive pages are looked up by their
+  // headers and only the archive head page is scanned for its end
+  int log_events = 0;
+  PersistentState(&mem).restoreFromMem([&](int, int) { log_events++; },
+                                       []() {}, [&]() { log_events++; });
+  PersistentState restored(&mem);
+  raw_mem.resetCounters();
+  restored.restoreFromMem(1, nullptr, [](int, int) {}, []() {}, []() {});
+  ASSERT_LE(raw_mem.bytesRead(), 4 * 128 + 10 * 64);
+  // history goes deep into the archive, far beyond the log
+  int size = restored.historySize();
+  ASSERT_GT(size, 2 * log_events);
+  std::vector<int> rows;
+  restored.readHistory(0, size,
+                       [&](int i, const PersistentState::HistoryRecord &r) {
+                         ASSERT_EQ(i, rows.size());
+                         rows.push_back(r.new_count ? -2 : r.value);
+                       });
+  ASSERT_TRUE(std::equal(rows.begin(), rows.end(), issued.end() - size));
+  // paging from the middle of the archive
+  rows.clear();
+  restored.readHistory(10, 50,
+                       [&](int, const PersistentState::HistoryRecord &r) {
+                         rows.push_back(r.new_count ? -2 : r.value);
+                       });
+  ASSERT_TRUE(std::equal(rows.begin(), rows.end(), issued.end() - size + 10));
+  ASSERT_EQ(rows.size(), 50);
+}
+
+TEST(state_test, persistent_state_archive_power_cut) {
+  const int mem_size = 1024;
+  for (int cut = 0;; ++cut) {
+    PersistentMemory raw_mem(true, mem_size);
+    PersistentMemoryWrapper mem(&raw_mem, mem_size);
+    mem.setup();
+    PersistentState s(&mem);
+    s.restoreFromMem([](int, int) {}, []() {}, []() {});
+    raw_mem.setWriteLimit(cut);
+    std::vector<int> issued;
+    int durable = 0;
+    for (int i = 1; i <= 400 && raw_mem.bytesWritten() <= cut; ++i) {
+      s.rememberNewValue(i % 5 == 0 ? i * 3 : i);
+      issued.push_back(i % 5 == 0 ? i * 3 : i);
+      if (i % 3 == 0)
+        s.flush();
+      if (raw_mem.bytesWritten() <= cut)
+        durable = issued.size() - s.pendingEvents();
+    }
+    bool completed = raw_mem.bytesWritten() <= cut;
+    raw_mem.setWriteLimit(-1);
+
+    // history of recovered log is a contiguous part of the script ending
+    // after every durable event, archived records are neither lost nor
+    // repeated
+    PersistentState next(&mem);
+    int log_events = 0;
+    next.restoreFromMem([&](int, int) { log_events++; }, []() {}, []() {});
+    std::vector<int> rows;
+    next.readHistory(0, next.historySize(),
+                     [&](int, const PersistentState::HistoryRecord &r) {
+                       rows.push_back(r.value);
+                     });
+    // records take at most 8 bytes, three full log pages are always kept
+    ASSERT_GE(rows.size(), std::min(durable, 3 * 128 / 8))
+        << "power cut after " << cut << " bytes";
+    bool matches = false;
+    for (int k = durable; k <= issued.size() && !matches; ++k)
+      matches = rows.size() <= k &&
+                std::equal(rows.begin(), rows.end(),
+                           issued.begin() + k - rows.size());
+    ASSERT_TRUE(matches) << "power cut after " << cut << " bytes";
+    if (completed) {
+      // the script wraps the log, so the archive is in use
+      ASSERT_GT(rows.size(), 2 * log_events);
+      break;
+    }
+  }
+}
+
+TEST(state_test, persistent_state_session_index) {
+  PersistentMemory raw_mem(true, 1024);
+  PersistentMemoryWrapper mem(&raw_mem, 1024);
+  mem.setup();
+  PersistentState s(&mem);
+  s.restoreFromMem([](int, int) { FAIL(); }, []() { FAIL(); },
+                   []() { FAIL(); });
+  ASSERT_EQ(s.lastSession(), 0);
+  // log wraps, the latest sessions are still kept
+  for (int session = 1; session <= 30; ++session) {
+    for (int i = 1; i <= 20; ++i)
+      s.rememberNewValue(session * 100 + i);
+    s.rememberStartNewCount();
+  }
+  s.rememberNewValue(7);
+  s.flush();
+
+  PersistentState restored(&mem);
+  restored.restoreFromMem(1, nullptr, [](int, int) {}, []() {}, []() {});
+  raw_mem.resetCounters();
+  ASSERT_EQ(restored.lastSession(), 30);
+  PersistentState::Session session;
+  ASSERT_TRUE(restored.findSession(30, session));
+  ASSERT_EQ(session.number, 30);
+  ASSERT_EQ(session.events, 30 * 21 - 1);
+  ASSERT_EQ(session.previous_value, 3020);
+  raw_mem.resetCounters();
+  ASSERT_TRUE(restored.findSession(25, session));
+  ASSERT_EQ(session.events, 25 * 21 - 1);
+  ASSERT_EQ(session.previous_value, 2520);
+  // checkpoint lookups and a page or two of records, not the whole log
+  ASSERT_LE(raw_mem.bytesRead(), 1024 / 2);
+  // only sessions starting in the kept records are found
+  ASSERT_FALSE(restored.findSession(1, session));
+  ASSERT_FALSE(restored.findSession(31, session));
+  ASSERT_FALSE(restored.findSession(0, session));
+
+  // session start is the first row of the session in the history
+  ASSERT_TRUE(restored.findSession(29, session));
+  int row = restored.sessionHistoryRow(session);
+  ASSERT_GE(row, 0);
+  restored.readHistory(row, 2,
+                       [&](int i, const PersistentState::HistoryRecord &r) {
+                         if (i == row)
+                           ASSERT_TRUE(r.new_count);
+                         else
+                           ASSERT_EQ(r.value, 3001);
+                       });
+  // sessions evicted from the log are found in the archive
+  raw_mem.resetCounters();
+  ASSERT_TRUE(restored.findSession(6, session));
+  ASSERT_EQ(session.events, 6 * 21 - 1);
+  ASSERT_EQ(session.previous_value, 620);
+  ASSERT_LE(raw_mem.bytesRead(), 1024);
+  ASSERT_FALSE(restored.findSession(5, session));
+
+  // new sessions continue the numbering
+  restored.rememberStartNewCount();
+  ASSERT_EQ(restored.lastSession(), 31);
+  ASSERT_TRUE(restored.findSession(31, session));
+  ASSERT_EQ(session.previous_value, 7);
+}
+
+TEST(state_test, persistent_state_time_travel) {
+  PersistentMemory raw_mem(true, 2048);
+  PersistentMemoryWrapper mem(&raw_mem, 2048);
+  mem.setup();
+  PersistentState s(&mem, 64);
+  s.restoreFromMem([](int, int) {}, []() {}, []() {});
+  // values[k] is the counter value after k records, new count every 40
+  std::vector<int> values = {0};
+  for (int i = 1; i <= 1600; ++i) {
+    if (i % 40 == 0) {
+      s.rememberStartNewCount();
+      values.push_back(0);
+    } else {
+      s.rememberNewValue(values.back() + (i % 7 == 0 ? i % 101 : 1));
+      values.push_back(values.back() + (i % 7 == 0 ? i % 101 : 1));
+    }
+  }
+  s.rememberNewValue(5);
+  values.push_back(5);
+  s.flush();
+
+  PersistentState restored(&mem, 64);
+  restored.restoreFromMem(1, nullptr, [](int, int) {}, []() {}, []() {});
+  PersistentState::Checkpoint cp;
+  ASSERT_TRUE(restored.stateAt(values.size() - 1, cp));
+  ASSERT_EQ(cp.value, 5);
+  ASSERT_FALSE(restored.stateAt(values.size(), cp));
+  // every kept point is found, deep in the archive as well
+  const uint32_t oldest = values.size() - 1 - restored.historySize();
+  ASSERT_LT(oldest, 1000);
+  for (uint32_t k = oldest; k < values.size(); ++k) {
+    raw_mem.resetCounters();
+    ASSERT_TRUE(restored.stateAt(k, cp)) << k;
+    ASSERT_EQ(cp.events, k);
+    ASSERT_EQ(cp.value, values[k]) << k;
+    ASSERT_EQ(cp.session_items, k % 40) << k;
+    // page lookups and a page of records, not the whole log
+    ASSERT_LE(raw_mem.bytesRead(), 18 * 64) << k;
+  }
+  ASSERT_FALSE(restored.stateAt(oldest - 1, cp));
+
+  PersistentState::Session session;
+  ASSERT_TRUE(restored.findSession(38, session));
+  ASSERT_TRUE(restored.sessionStartState(38, cp));
+  ASSERT_EQ(cp.events, session.events + 1);
+  ASSERT_EQ(cp.value, 0);
+  ASSERT_EQ(cp.session_items, 0);
+  ASSERT_EQ(values[cp.events - 1], session.previous_value);
+  ASSERT_FALSE(restored.sessionStartState(41, cp));
+}
+
+TEST(state_test, persistent_state_timestamps) {
+  const uint32_t unit = PersistentState::time_unit_ms;
+  PersistentMemory raw_mem(true, 2048);
+  PersistentMemoryWrapper mem(&raw_mem, 2048);
+  mem.setup();
+  unsigned long uptime = 5000;
+  PersistentState s(&mem, 64);
+  s.setClock([&]() { return uptime; });
+  s.restoreFromMem([](int, int) {}, []() {}, []() {});
+  // pauses shorter than 128 time units take a single byte
+  raw_mem.resetCounters();
+  s.rememberNewValue(1);
+  s.flush();
+  ASSERT_EQ(raw_mem.bytesWritten(), 1 + 1 + 1 + 1);
+  std::vector<uint32_t> times = {5000 / unit};
+  // enough records to push the oldest ones to the archive
+  for (int i = 2; i <= 600; ++i) {
+    uptime += i % 3 ? 2000 : 20000 + i;
+    if (i % 50 == 0)
+      s.rememberStartNewCount();
+    else
+      s.rememberNewValue(i);
+    times.push_back(uptime / unit);
+  }
+  s.flush();
+
+  // log time continues after restart, while uptime starts again
+  uptime = 1500;
+  PersistentState restarted(&mem, 64);
+  restarted.setClock([&]() { return uptime; });
+  restarted.restoreFromMem(1, nullptr, [](int, int) {}, []() {}, []() {});
+  restarted.rememberNewValue(7);
+  times.push_back(times.back() + 1500 / unit);
+  restarted.flush();
+
+  int size = restarted.historySize();
+  ASSERT_GT(size, 300);
+  ASSERT_LT(size, times.size());
+  int row = 0;
+  restarted.readHistory(
+      0, size, [&](int i, const PersistentState::HistoryRecord &r) {
+        ASSERT_EQ(i, row++);
+        const int k = times.size() - size + i;
+        ASSERT_EQ(r.time, times[k]) << k;
+        ASSERT_EQ(r.interval, times[k] - times[k - 1]) << k;
+      });
+  ASSERT_EQ(row, size);
+  PersistentState::Checkpoint cp;
+  ASSERT_TRUE(restarted.stateAt(times.size() - 2, cp));
+  ASSERT_EQ(cp.time, times[times.size() - 3]);
+  uint32_t last_time = 0;
+  restarted.decodeLog(
+      [&](const PersistentState::LogRecord &r) { last_time = r.time; });
+  ASSERT_EQ(last_time, times.back());
+
+  // without the clock time does not change
+  PersistentState still(&mem, 64);
+  still.rememberNewValue(8);
+  int last = still.historySize() - 1;
+  still.readHistory(last, 1, [&](int, const PersistentState::HistoryRecord &r) {
+    ASSERT_EQ(r.value, 8);
+    ASSERT_EQ(r.time, times.back());
+    ASSERT_EQ(r.interval, 0);
+  });
+}
+
+TEST(state_test, persistent_state_decode_log) {
+  std::string path = testing::TempDir() + "counter_dump.bin";
+  std::remove(path.c_str());
+  {
+    PersistentMemory raw_mem(path.c_str(), 1024);
+    PersistentMemoryWrapper mem(&raw_mem, 1024);
+    mem.setup();
+    PersistentState s(&mem);
+    s.restoreFromMem([](int, int) {}, []() {}, []() {});
+    for (int session = 1; session <= 30; ++session) {
+      for (int i = 1; i <= 20; ++i)
+        s.rememberNewValue(session * 100 + i);
+      s.rememberStartNewCount();
+    }
+    s.rememberClearHistory();
+    s.rememberNewValue(7);
+    s.flush();
+  }
+
+  // dump is decoded read only, log has wrapped, sessions are
+  // numbered by the checkpoints
+  PersistentMemory raw_mem(path.c_str());
+  ASSERT_TRUE(raw_mem.begin());
+  ASSERT_EQ(raw_mem.size(), 1024);
+  PersistentMemoryWrapper mem(&raw_mem, raw_mem.size());
+  mem.setup();
+  PersistentState s(&mem);
+  std::vector<PersistentState::LogRecord> records;
+  s.decodeLog([&](const PersistentState::LogRecord &r) {
+    records.push_back(r);
+  });
+  ASSERT_EQ(raw_mem.bytesWritten(), 0);
+  ASSERT_GT(records.size(), 100);
+  ASSERT_LT(records.size(), 30 * 21);
+  // archived records come first and continue to the log records
+  ASSERT_TRUE(records[0].archived);
+  ASSERT_FALSE(records.back().archived);
+  ASSERT_TRUE(std::is_partitioned(
+      records.begin(), records.end(),
+      [](const PersistentState::LogRecord &r) { return r.archived; }));
+  int previous = records[0].value - records[0].delta;
+  for (size_t i = 0; i < records.size(); ++i) {
+    const auto &r = records[i];
+    ASSERT_GE(r.offset, 0);
+    ASSERT_LT(r.offset, 1024);
+    ASSERT_EQ(r.events, records[0].events + i);
+    if (r.opcode == PersistentState::LogRecord::new_value) {
+      ASSERT_EQ(r.value, previous + r.delta);
+      if (r.value >= 100)
+        ASSERT_EQ(r.session, r.value / 100 - 1);
+    } else if (r.opcode == PersistentState::LogRecord::new_count) {
+      ASSERT_EQ(r.session, previous / 100);
+    }
+    previous = r.value;
+  }
+  ASSERT_EQ(records[records.size() - 2].opcode,
+            PersistentState::LogRecord::clear_history);
+  ASSERT_EQ(records.back().value, 7);
+  ASSERT_EQ(records.back().session, 30);
+  ASSERT_EQ(records.back().events, 30 * 21 + 1);
+  std::remove(path.c_str());
+
+  // log has not wrapped
+  PersistentMemory small_raw(true, 256);
+  PersistentMemoryWrapper small(&small_raw, 256);
+  small.setup();
+  PersistentState writer(&small, 64);
+  writer.restoreFromMem([](int, int) {}, []() {}, []() {});
+  writer.rememberNewValue(5);
+  writer.rememberStartNewCount();
+  writer.rememberNewValue(-3);
+  writer.flush();
+  PersistentState reader(&small, 64);
+  records.clear();
+  reader.decodeLog([&](const PersistentState::LogRecord &r) {
+    records.push_back(r);
+  });
+  ASSERT_EQ(records.size(), 3);
+  ASSERT_EQ(records[0].events, 0);
+  ASSERT_EQ(records[0].session, 0);
+  ASSERT_EQ(records[0].delta, 5);
+  ASSERT_EQ(records[1].opcode, PersistentState::LogRecord::new_count);
+  ASSERT_EQ(records[1].session, 1);
+  ASSERT_EQ(records[1].offset, records[0].offset + 3);
+  ASSERT_EQ(records[2].value, -3);
+  ASSERT_EQ(records[2].delta, -3);
+  ASSERT_EQ(records[2].session, 1);
+
+  PersistentMemory missing("/nonexistent/counter_dump.bin");
+  ASSERT_FALSE(missing.begin());
+}
+
+// runs fram_stats and returns its output without the timing line
+std::string runFramStats(const std::string &args) {
+  std::string output;
+  FILE *pipe = popen((std::string(FRAM_STATS_PATH) + " " + args).c_str(), "r");
+  if (!pipe)
+    return output;
+  char line[256];
+  while (fgets(line, sizeof(line), pipe))
+    if (strncmp(line, "threads ", 8) != 0)
+      output += line;
+  pclose(pipe);
+  return output;
+}
+
+TEST(state_test, fram_stats_dumps) {
+  const std::string dir = testing::TempDir() + "fram_stats_dumps";
+  mkdir(dir.c_str(), 0755);
+  auto writeDump = [&](const std::string &name, int sessions) {
+    const std::string path = dir + "/" + name;
+    std::remove(path.c_str());
+    PersistentMemory raw_mem(path.c_str(), 1024);
+    PersistentMemoryWrapper mem(&raw_mem, 1024);
+    mem.setup();
+    PersistentState s(&mem);
+    s.restoreFromMem([](int, int) {}, []() {}, []() {});
+    for (int session = 1; session <= sessions; ++session) {
+      for (int i = 1; i <= 20; ++i)
+        s.rememberNewValue(session * 100 + i);
+      s.rememberStartNewCount();
+    }
+    s.rememberNewValue(7);
+    s.flush();
+    return path;
+  };
+  // records of the dump, damage is checked after it is changed
+  auto decode = [](const std::string &path,
+                   std::vector<PersistentState::LogRecord> &records) {
+    PersistentMemory raw_mem(path.c_str());
+    raw_mem.begin();
+    PersistentMemoryWrapper mem(&raw_mem, raw_mem.size());
+    mem.setup();
+    records.clear();
+    return PersistentState(&mem).decodeLog(
+        [&](const PersistentState::LogRecord &r) { records.push_back(r); });
+  };
+  auto poke = [](const std::string &path, int addr, uint8_t bits) {
+    PersistentMemory raw_mem(path.c_str(), 1024);
+    PersistentMemoryWrapper mem(&raw_mem, 1024);
+    mem.setup();
+    mem.write(addr, mem.read(addr) ^ bits);
+  };
+
+  // log and archive of the shipped memory
+  std::vector<PersistentState::LogRecord> records;
+  const std::string clean = writeDump("clean.bin", 30);
+  PersistentState::LogDamage damage = decode(clean, records);
+  ASSERT_EQ(damage.torn_tails + damage.broken_pages, 0);
+  const long clean_records = records.size();
+  const long archived = std::count_if(
+      records.begin(), records.end(),
+      [](const PersistentState::LogRecord &r) { return r.archived; });
+  ASSERT_GT(archived, 0);
+
+  // torn append: type of the next record is written, its time and crc
+  // are not, short delta records take 3 bytes without elapsed time
+  const std::string torn = writeDump("torn.bin", 3);
+  decode(torn, records);
+  poke(torn, records.back().offset + 3, 0x82);
+  damage = decode(torn, records);
+  ASSERT_EQ(damage.torn_tails, 1);
+  ASSERT_EQ(damage.broken_pages, 0);
+  const long torn_records = records.size();
+
+  // bad crc of the first record in the oldest log page drops the rest of
+  // the page, the following pages are still decoded
+  const std::string bad_crc = writeDump("bad_crc.bin", 30);
+  decode(bad_crc, records);
+  auto first_logged =
+      std::find_if(records.begin(), records.end(),
+                   [](const PersistentState::LogRecord &r) {
+                     return !r.archived;
+                   });
+  poke(bad_crc, first_logged->offset + 2, 0x10);
+  damage = decode(bad_crc, records);
+  ASSERT_EQ(damage.torn_tails, 0);
+  ASSERT_EQ(damage.broken_pages, 1);
+  ASSERT_LT(records.size(), clean_records);
+  ASSERT_EQ(records.back().value, 7);
+  const long bad_crc_records = records.size();
+
+  // blank memory has no records
+  std::remove((dir + "/blank.bin").c_str());
+  {
+    PersistentMemory blank((dir + "/blank.bin").c_str(), 1024);
+  }
+
+  // work is split between threads, the totals do not depend on it
+  const std::string single = runFramStats("--threads 1 " + dir);
+  ASSERT_EQ(runFramStats("--threads 3 " + dir), single);
+  auto line = [&](const char *name) {
+    size_t start = single.find(name);
+    return start == std::string::npos
+               ? std::string()
+               : single.substr(start, single.find('\n', start) - start);
+  };
+  ASSERT_EQ(line("images"), "images        4 (0.0 MB)");
+  ASSERT_EQ(line("empty"), "empty         1");
+  ASSERT_EQ(line("wrapped"), "wrapped       2");
+  ASSERT_EQ(line("torn tail"), "torn tail     1");
+  ASSERT_EQ(line("broken"), "broken        1 (1 pages)");
+  ASSERT_EQ(line("records"),
+            "records       " +
+                std::to_string(clean_records + torn_records +
+                               bad_crc_records) +
+                ", " + std::to_string(2 * archived) + " archived");
+}
+
+TEST(state_test, log_sync_over_pty) {
+  // device end of the serial line is the pty master, host uses the slave
+  int device_fd = posix_openpt(O_RDWR | O_NOCTTY);
+  ASSERT_GE(device_fd, 0);
+  ASSERT_EQ(grantpt(device_fd), 0);
+  ASSERT_EQ(unlockpt(device_fd), 0);
+  int host_fd = open(ptsname(device_fd), O_RDWR | O_NOCTTY);
+  ASSERT_GE(host_fd, 0);
+  termios line;
+  tcgetattr(host_fd, &line);
+  cfmakeraw(&line);
+  tcsetattr(host_fd, TCSANOW, &line);
+  fcntl(device_fd, F_SETFL, O_NONBLOCK);
+  fcntl(host_fd, F_SETFL, O_NONBLOCK);
+
+  PersistentMemory raw_mem(true, 2048);
+  PersistentMemoryWrapper mem(&raw_mem, 2048);
+  mem.setup();
+  PersistentState s(&mem, 64);
+  unsigned long uptime = 0;
+  s.setClock([&]() { return uptime; });
+  s.restoreFromMem([](int, int) {}, []() {}, []() {});
+  // expected[k] is the value after record k
+  std::vector<int> expected;
+  std::vector<bool> new_counts;
+  int value = 0;
+  auto log = [&](int records) {
+    for (int i = 0; i < records; ++i) {
+      uptime += 700;
+      if (expected.size() % 30 == 29) {
+        s.rememberStartNewCount();
+        value = 0;
+      } else {
+        value += expected.size() % 5 - 1;
+        s.rememberNewValue(value);
+      }
+      expected.push_back(value);
+      new_counts.push_back(expected.size() % 30 == 0);
+    }
+  };
+  log(100);
+
+  LogSync sync;
+  int corrupt_write = -1;
+  int writes = 0;
+  int shipped = 0;
+  std::vector<uint8_t> other;
+  sync.setup(
+      &s,
+      [&]() {
+        uint8_t byte = 0;
+        return read(device_fd, &byte, 1) == 1 ? byte : -1;
+      },
+      [&](const uint8_t *data, int len) {
+        // answer is written in pieces, so update() is not blocked
+        ASSERT_TRUE(len <= LogSync::max_write_size);
+        std::vector<uint8_t> piece(data, data + len);
+        if (writes++ == corrupt_write)
+          piece[len / 2] ^= 0x10;
+        shipped += len;
+        ASSERT_EQ(write(device_fd, piece.data(), len), len);
+      },
+      [&](uint8_t byte) { other.push_back(byte); });
+
+  // host stand-in asks for records after the last received one until it
+  // has them all, chunk which is broken or not answered is asked again
+  std::vector<LogSync::Record> received;
+  uint32_t next = 0;
+  int requests = 0;
+  auto pull = [&]() {
+    for (uint32_t total = next + 1; next < total;) {
+      uint8_t request[LogSync::max_request_size];
+      int len = LogSync::putRequest(request, next);
+      ASSERT_EQ(write(host_fd, request, len), len);
+      requests++;
+      ASSERT_LT(requests, 100);
+      int polls = 0;
+      do
+        polls++;
+      while (sync.poll(), sync.sending());
+      ASSERT_GT(polls, 1);
+      std::vector<uint8_t> in;
+      uint8_t buffer[256];
+      for (int n; (n = read(host_fd, buffer, sizeof(buffer))) > 0;)
+        in.insert(in.end(), buffer, buffer + n);
+      LogSync::parseChunk(in.data(), in.size(), next, total,
+                          [&](const LogSync::Record &r) {
+                            received.push_back(r);
+                          });
+    }
+  };
+  pull();
+  ASSERT_EQ(received.size(), 100);
+  ASSERT_EQ(requests, (100 + LogSync::max_chunk_records - 1) /
+                          LogSync::max_chunk_records);
+  for (size_t k = 0; k < received.size(); ++k) {
+    const LogSync::Record &r = received[k];
+    ASSERT_EQ(r.events, k);
+    ASSERT_EQ(r.opcode == PersistentState::LogRecord::new_count,
+              new_counts[k]);
+    ASSERT_EQ(r.value, expected[k]) << k;
+    ASSERT_EQ(r.time, (k + 1) * 700 / PersistentState::time_unit_ms);
+  }
+
+  // only new records are shipped, broken chunk is asked again
+  log(40);
+  corrupt_write = writes + 1;
+  requests = 0;
+  shipped = 0;
+  pull();
+  ASSERT_EQ(received.size(), 140);
+  ASSERT_EQ(requests, 3);
+  ASSERT_LT(shipped, 6 * 40);
+  for (size_t k = 100; k < received.size(); ++k)
+    ASSERT_EQ(received[k].value, expected[k]) << k;
+
+  // broken request is not answered, other bytes are passed through
+  uint8_t request[LogSync::max_request_size];
+  int len = LogSync::putRequest(request, 0);
+  request[len - 1] ^= 1;
+  ASSERT_EQ(write(host_fd, "s", 1), 1);
+  ASSERT_EQ(write(host_fd, request, len), len);
+  writes = 0;
+  sync.poll();
+  ASSERT_EQ(writes, 0);
+  ASSERT_EQ(other, std::vector<uint8_t>({'s'}));
+
+  // chunk with a valid crc but a broken second record delivers nothing
+  auto crc8 = [](const std::vector<uint8_t> &bytes) {
+    uint8_t crc = 0xff;
+    for (uint8_t byte : bytes) {
+      crc ^= byte;
+      for (int bit = 0; bit < 8; ++bit)
+        crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc;
+  };
+  // first 0, 2 logged, 2 records, value and time 0, 4 data bytes: delta
+  // of 1 and unknown record type 5, both with no elapsed time
+  std::vector<uint8_t> forged = {'C', 0, 2, 2, 0, 0, 4, 0x82, 0, 5, 0};
+  forged.push_back(crc8(forged));
+  uint32_t forged_next = 7;
+  uint32_t forged_total = 7;
+  int delivered = 0;
+  ASSERT_EQ(LogSync::parseChunk(forged.data(), forged.size(), forged_next,
+                                forged_total,
+                                [&](const LogSync::Record &) { delivered++; }),
+            -1);
+  ASSERT_EQ(delivered, 0);
+  ASSERT_EQ(forged_next, 7);
+  // the same chunk with a valid second record is delivered
+  forged[9] = 3;
+  forged.back() = crc8({forged.begin(), forged.end() - 1});
+  ASSERT_EQ(LogSync::parseChunk(forged.data(), forged.size(), forged_next,
+                                forged_total,
+                                [&](const LogSync::Record &) { delivered++; }),
+            forged.size());
+  ASSERT_EQ(delivered, 2);
+  ASSERT_EQ(forged_next, 2);
+
+  // records evicted from the log and the archive are skipped
+  log(2000);
+  received.clear();
+  next = 0;
+  requests = 0;
+  pull();
+  ASSERT_GT(received.front().events, 0);
+  ASSERT_EQ(received.back().events, expected.size() - 1);
+  ASSERT_EQ(next, expected.size());
+  for (const LogSync::Record &r : received)
+    ASSERT_EQ(r.value, expected[r.events]) << r.events;
+  close(host_fd);
+  close(device_fd);
+}
+
+TEST(state_test, snapshot_state) {
+  const int window = SnapshotState::history_window;
+  const int max_pending = SnapshotState::max_pending_events;
+  PersistentMemory raw_mem(true, 1024);
+  PersistentMemoryWrapper mem(&raw_mem, 1024);
+  mem.setup();
+  SnapshotState s(&mem);
+  s.restoreFromMem(
+      8, [](const SnapshotState::Checkpoint &cp) { ASSERT_EQ(cp.events, 0); },
+      [](int, int) { FAIL(); }, []() { FAIL(); }, []() { FAIL(); });
+  for (int i = 1; i <= 5; ++i)
+    s.rememberNewValue(i * 10);
+  s.rememberClearHistory();
+  for (int i = 1; i <= 50; ++i) {
+    if (i % 20 == 0)
+      s.rememberStartNewCount();
+    s.rememberNewValue(i);
+  }
+  // events are written only when the queue is full or flushed
+  ASSERT_LT(s.pendingEvents(), max_pending);
+  ASSERT_GT(s.pendingEvents(), 0);
+  s.flush();
+  ASSERT_EQ(s.pendingEvents(), 0);
+
+  // restore is a bounded read of both banks, nothing is replayed
+  // but the values of the current count
+  SnapshotState restored(&mem);
+  raw_mem.resetCounters();
+  std::vector<int> values;
+  int checkpoint_value = -1;
+  restored.restoreFromMem(
+      8,
+      [&](const SnapshotState::Checkpoint &cp) {
+        ASSERT_EQ(cp.events, 5 + 1 + 52 - 8);
+        ASSERT_EQ(cp.session_items, 11 - 8);
+        checkpoint_value = cp.value;
+      },
+      [&](int value, int delta) {
+        ASSERT_EQ(delta, values.empty() ? value - checkpoint_value : 1);
+        values.push_back(value);
+      },
+      []() { FAIL(); }, []() { FAIL(); });
+  ASSERT_LE(raw_mem.bytesRead(), 2 * 320);
+  ASSERT_EQ(checkpoint_value, 42);
+  ASSERT_EQ(values, std::vector<int>({43, 44, 45, 46, 47, 48, 49, 50}));
+
+  // history keeps the last records since history was cleared
+  ASSERT_EQ(restored.historySize(), window);
+  std::vector<int> rows;
+  restored.readHistory(
+      10, 100, [&](int i, const PersistentState::HistoryRecord &r) {
+        ASSERT_EQ(i, 10 + rows.size());
+        rows.push_back(r.new_count ? -1 : r.value);
+        if (r.value == 40)
+          ASSERT_EQ(r.delta, 40);
+        if (!r.new_count)
+          ASSERT_EQ(r.item_no, r.value);
+      });
+  ASSERT_EQ(rows.size(), window - 10);
+  ASSERT_EQ(rows[0], 30);
+  ASSERT_EQ(rows[10], -1);
+  ASSERT_EQ(rows[11], 40);
+  ASSERT_EQ(rows.back(), 50);
+
+  // banks alternate, old bank is still valid when the new one is broken
+  restored.rememberNewValue(51);
+  restored.flush();
+  SnapshotState last(&mem);
+  last.restoreFromMem(1, nullptr, [](int value, int) { ASSERT_EQ(value, 51); },
+                      nullptr, nullptr);
+  // bank of 25 header bytes, window entries of 9 bytes and crc
+  const int bank_size = 25 + window * 9 + 1;
+  std::vector<int> values_with_broken_bank;
+  for (int addr : {0, bank_size}) {
+    mem.write(addr, mem.read(addr) ^ 1);
+    SnapshotState broken(&mem);
+    int value = 0;
+    broken.restoreFromMem(
+        1, [&](const SnapshotState::Checkpoint &cp) { value = cp.value; },
+        [&](int v, int) { value = v; }, nullptr, nullptr);
+    values_with_broken_bank.push_back(value);
+    mem.write(addr, mem.read(addr) ^ 1);
+  }
+  std::sort(values_with_broken_bank.begin(), values_with_broken_bank.end());
+  ASSERT_EQ(values_with_broken_bank, std::vector<int>({50, 51}));
+}
+
+TEST(state_test, snapshot_state_power_cut) {
+  for (int cut = 0;; ++cut) {
+    PersistentMemory raw_mem(true, 1024);
+    PersistentMemoryWrapper mem(&raw_mem, 1024);
+    mem.setup();
+    SnapshotState s(&mem);
+    for (int i = 1; i <= 3; ++i) {
+      s.rememberNewValue(i);
+      s.flush();
+    }
+    raw_mem.resetCounters();
+    raw_mem.setWriteLimit(cut);
+    s.rememberNewValue(4);
+    s.flush();
+    bool completed = raw_mem.bytesWritten() <= cut;
+    raw_mem.setWriteLimit(-1);
+
+    // either the old or the new snapshot is restored, never a mix
+    SnapshotState restored(&mem);
+    int value = 0;
+    restored.restoreFromMem(
+        1, [&](const SnapshotState::Checkpoint &cp) { value = cp.value; },
+        [&](int v, int) { value = v; }, nullptr, nullptr);
+    ASSERT_EQ(restored.historySize(), value) << "power cut after " << cut;
+    if (completed) {
+      ASSERT_EQ(value, 4);
+      break;
+    }
+    ASSERT_TRUE(value == 3 || value == 4) << "power cut after " << cut;
   }
 }
 
@@ -824,6 +2627,7 @@ TEST(state_test, invalid_persisten_state_test) {
   s1.rememberStartNewCount();
   s1.rememberClearHistory();
   s1.rememberNewValue(32);
+  s1.flush();
   PersistentState s2(&mem);
   s2.restoreFromMem([](int, int) { FAIL(); }, []() { FAIL(); },
                     []() { FAIL(); });
@@ -899,6 +2703,56 @@ TEST(widget_test, history_wrap_navigation) {
   ASSERT_EQ(list.getFirstVisibleItem(), 0);
 }
 
+TEST(widget_test, paged_list_loading) {
+  Display d;
+  PersistentMemory pm(true, 1024);
+  PersistentMemoryWrapper mem(&pm, 1024);
+  HAL h(&d, &mem);
+  PagedListWidget<8> list;
+  int size = 1000;
+  std::vector<std::pair<int, int>> loads;
+  list.setParams(
+      100, CHAR_H * 4, [&]() { return size; },
+      [&](int first, int count, PagedListWidget<8>::Item *items) {
+        loads.push_back({first, count});
+        for (int i = 0; i < count; ++i)
+          snprintf(items[i], MAX_HIST_STR_LEN, "item %d", first + i);
+      });
+  list.setPos(&h, 0, 0);
+
+  char buffer[MAX_HIST_STR_LEN + 1];
+  list.getItem(0, buffer, MAX_HIST_STR_LEN);
+  ASSERT_STREQ(buffer, "item 0");
+  list.getItem(7, buffer, MAX_HIST_STR_LEN);
+  ASSERT_STREQ(buffer, "item 7");
+  ASSERT_EQ(loads, (std::vector<std::pair<int, int>>{{0, 8}}));
+  // only a window around requested item is loaded
+  list.getItem(500, buffer, MAX_HIST_STR_LEN);
+  ASSERT_STREQ(buffer, "item 500");
+  list.getItem(497, buffer, MAX_HIST_STR_LEN);
+  list.getItem(503, buffer, MAX_HIST_STR_LEN);
+  ASSERT_EQ(loads.back(), std::make_pair(496, 8));
+  ASSERT_EQ(loads.size(), 2);
+  list.getItem(999, buffer, MAX_HIST_STR_LEN);
+  ASSERT_STREQ(buffer, "item 999");
+  ASSERT_EQ(loads.back(), std::make_pair(992, 8));
+
+  // scrolling up from the top goes to the oldest items
+  list.moveUp();
+  ASSERT_EQ(list.getFirstVisibleItem(), 996);
+  size = 1001;
+  list.invalidate();
+  ASSERT_EQ(list.getSize(), 1001);
+  list.getItem(999, buffer, MAX_HIST_STR_LEN);
+  ASSERT_EQ(loads.back(), std::make_pair(993, 8));
+
+  // jump to a session start
+  list.scrollTo(500);
+  ASSERT_EQ(list.getFirstVisibleItem(), 500);
+  list.scrollTo(2000);
+  ASSERT_EQ(list.getFirstVisibleItem(), 997);
+}
+
 TEST(widget_test, repeating_button) {
   Display d;
   PersistentMemory pm(true, 1024);
@@ -952,4 +2806,57 @@ TEST(screen_test, main_screen_history) {
   screen.draw();
 }
 
+TEST(screen_test, main_screen_draw_changed) {
+  Display d;
+  PersistentMemory pm(true, 1024);
+  PersistentMemoryWrapper mem(&pm, 1024);
+  HAL h(&d, &mem);
+  EXPECT_CALL(d, width()).WillRepeatedly(Return(128));
+  EXPECT_CALL(d, height()).WillRepeatedly(Return(64));
+  EXPECT_CALL(d, setTextColor(::testing::_)).WillRepeatedly(Return());
+  EXPECT_CALL(d, setTextSize(::testing::_)).WillRepeatedly(Return());
+  EXPECT_CALL(d, setCursor(::testing::_, testing::_)).WillRepeatedly(Return());
+  counter_gui::MainScreen screen;
+  screen.setup(
+      &h, [](int) {}, [](int) {}, [](int) {});
+  auto expectLabels = [&](int plus_1, int plus_5, int menu, int counter,
+                          int history) {
+    EXPECT_CALL(d, print(Matcher<const char *>(StrEq("+1/-1"))))
+        .Times(plus_1);
+    EXPECT_CALL(d, print(Matcher<const char *>(StrEq("+5/-5"))))
+        .Times(plus_5);
+    EXPECT_CALL(d, print(Matcher<const char *>(StrEq("menu")))).Times(menu);
+    EXPECT_CALL(d, print(Matcher<const char *>(StrEq("0")))).Times(counter);
+    EXPECT_CALL(d, print(Matcher<const char *>(StrEq("item")))).Times(history);
+  };
+
+  // whole display is cleared once
+  expectUpdateButtons(h, 0, false, false, false);
+  EXPECT_CALL(d, fillRect(0, 0, 128, 64, Color::BLACK));
+  expectLabels(1, 1, 1, 1, 0);
+  ASSERT_TRUE(screen.update());
+  screen.redraw();
+  ASSERT_FALSE(screen.update());
+
+  // pressed button clears the lines under its label only
+  expectUpdateButtons(h, 100, true, false, false);
+  EXPECT_CALL(d, fillRect(0, 53 + CHAR_H, 5 * CHAR_W, 3, Color::BLACK));
+  expectLabels(1, 0, 0, 0, 0);
+  ASSERT_TRUE(screen.update());
+  screen.drawChanged();
+
+  // changed areas of both buttons and the history are cleared,
+  // counter is not touched
+  expectUpdateButtons(h, 200, true, true, false);
+  screen.addHistoryItem("item");
+  EXPECT_CALL(d, fillRect(0, 53 + CHAR_H, 5 * CHAR_W, 3, Color::BLACK));
+  EXPECT_CALL(d, fillRect(49, 53 + CHAR_H, 5 * CHAR_W, 3, Color::BLACK));
+  EXPECT_CALL(d, fillRect(72, 0, 56, 53, Color::BLACK));
+  EXPECT_CALL(d, drawFastHLine(0, 63, ::testing::_, Color::WHITE));
+  EXPECT_CALL(d, drawFastHLine(0, 61, 2 * CHAR_W, Color::WHITE));
+  expectLabels(1, 1, 0, 0, 1);
+  ASSERT_TRUE(screen.update());
+  screen.drawChanged();
+}
+
 #endif
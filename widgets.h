@@ -14,6 +14,37 @@
 #define MAX_LABEL_LEN 21
 #define MAX_WIDGETS 10
 
+/**
+ * @brief screen area, widgets report areas changed by update()
+ */
+struct Rect {
+  int x = 0;
+  int y = 0;
+  int w = 0;
+  int h = 0;
+
+  bool empty() const { return w <= 0 || h <= 0; }
+
+  bool intersects(const Rect &r) const {
+    return !empty() && !r.empty() && x < r.x + r.w && r.x < x + w &&
+           y < r.y + r.h && r.y < y + h;
+  }
+
+  // smallest rect covering both
+  Rect merged(const Rect &r) const {
+    if (empty())
+      return r;
+    if (r.empty())
+      return *this;
+    Rect m;
+    m.x = std::min(x, r.x);
+    m.y = std::min(y, r.y);
+    m.w = std::max(x + w, r.x + r.w) - m.x;
+    m.h = std::max(y + h, r.y + r.h) - m.y;
+    return m;
+  }
+};
+
 /**
  * @brief abstract class controlling "multistate" button state
  *
@@ -155,6 +186,18 @@ public:
   virtual void reset() = 0;
   virtual bool update() = 0;
   virtual void draw() const = 0;
+
+  Rect bounds() const {
+    Rect r;
+    r.x = off_x;
+    r.y = off_y;
+    r.w = getW();
+    r.h = getH();
+    return r;
+  }
+
+  // area to clear when update() returns true, draw() repaints the widget
+  virtual Rect changedArea() const { return bounds(); }
 };
 
 class ThreeStateButtonWidget : public Widget {
@@ -182,6 +225,14 @@ public:
 
   int getH() const override { return CHAR_H + 3; }
 
+  // label does not change, only the lines under it
+  Rect changedArea() const override {
+    Rect r = bounds();
+    r.y += CHAR_H;
+    r.h -= CHAR_H;
+    return r;
+  }
+
   void reset() override { state.reset(); }
 
   bool update() override {
@@ -252,6 +303,14 @@ public:
 
   int getH() const override { return CHAR_H + 1; }
 
+  // label does not change, only the line under it
+  Rect changedArea() const override {
+    Rect r = bounds();
+    r.y += CHAR_H;
+    r.h -= CHAR_H;
+    return r;
+  }
+
   void reset() override { state.reset(); }
 
   bool update() override {
@@ -302,6 +361,14 @@ public:
 
   int getH() const override { return CHAR_H + 1; }
 
+  // label does not change, only the line under it
+  Rect changedArea() const override {
+    Rect r = bounds();
+    r.y += CHAR_H;
+    r.h -= CHAR_H;
+    return r;
+  }
+
   void reset() override { state.reset(); }
 
   bool update() override {
@@ -360,6 +427,14 @@ public:
     first_visible_item = std::max(0, d().getSize() - visible_items);
   }
 
+  // shows given item at the top, if the list is long enough
+  void scrollTo(int item) {
+    int visible_items = h / CHAR_H;
+    int last_possible_position = std::max(0, d().getSize() - visible_items);
+    first_visible_item = std::max(0, std::min(item, last_possible_position));
+    updated = true;
+  }
+
   void moveUp() {
     if (first_visible_item > 0) {
       first_visible_item--;
@@ -368,6 +443,7 @@ public:
       int visible_items = h / CHAR_H;
       int last_possible_positions = std::max(0, d().getSize() - visible_items);
       first_visible_item = last_possible_positions;
+      updated = true;
     }
   }
 
@@ -448,6 +524,75 @@ public:
   }
 };
 
+/**
+ * @brief list of items loaded on demand
+ *
+ * Only CACHE_ITEMS items around the requested one are kept in RAM,
+ * others are loaded again when they become visible.
+ */
+template <int CACHE_ITEMS, int MAX_ITEM_LEN = MAX_HIST_STR_LEN>
+class PagedListWidget
+    : public ListWidgetBase<PagedListWidget<CACHE_ITEMS, MAX_ITEM_LEN>,
+                            MAX_ITEM_LEN> {
+public:
+  using Item = char[MAX_ITEM_LEN + 1];
+  // returns number of items
+  using SizeSource = std::function<int()>;
+  // fills items with strings [first, first + count)
+  using Loader = std::function<void(int first, int count, Item *items)>;
+
+private:
+  SizeSource size_source;
+  Loader loader;
+  mutable Item items[CACHE_ITEMS];
+  mutable int size = -1; // not known until requested
+  mutable int cache_first = 0;
+  mutable int cache_size = 0;
+  using Base =
+      ListWidgetBase<PagedListWidget<CACHE_ITEMS, MAX_ITEM_LEN>, MAX_ITEM_LEN>;
+
+public:
+  void setParams(int width, int height, SizeSource source, Loader l) {
+    size_source = source;
+    loader = l;
+    reset();
+    Base::setParams(width, height);
+  }
+
+  // items are changed, cached ones are dropped
+  void invalidate() {
+    size = -1;
+    cache_size = 0;
+    Base::updated = true;
+  }
+
+  int getSize() const {
+    if (size < 0)
+      size = size_source();
+    return size;
+  }
+
+  void getItem(int i, char *buffer, int max_str_len) const {
+    if (i < cache_first || i >= cache_first + cache_size) {
+      // load items around the requested one, so scrolling in any
+      // direction hits the cache
+      cache_first = std::max(0, std::min(i - CACHE_ITEMS / 2,
+                                         getSize() - CACHE_ITEMS));
+      cache_size = std::min(CACHE_ITEMS, getSize() - cache_first);
+      for (int j = 0; j < cache_size; ++j)
+        items[j][0] = '\0';
+      loader(cache_first, cache_size, items);
+    }
+    strncpy(buffer, items[i - cache_first], max_str_len);
+    buffer[max_str_len] = '\0';
+  }
+
+  void reset() override {
+    Base::reset();
+    invalidate();
+  }
+};
+
 template <int MAX_ITEMS, int MAX_LEN = MAX_HIST_STR_LEN>
 class ListWithSelectorWidget
     : public ListWidgetBase<ListWithSelectorWidget<MAX_ITEMS, MAX_LEN>,